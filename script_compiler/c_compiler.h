@@ -0,0 +1,201 @@
+#pragma once
+#include <luisa/core/logging.h>
+#include <luisa/core/stl/filesystem.h>
+#include <luisa/core/stl/string.h>
+#include <luisa/core/stl/vector.h>
+#include <luisa/vstl/functional.h>
+#include "utils.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <spawn.h>
+#include <sys/wait.h>
+extern char** environ;
+#endif
+
+// C compiler runs of --cc.
+// Every compile runs on a thread of its own pool, so the fiber workers keep generating scripts while the compiler
+// processes are waited on. The compiler is started with an argument vector instead of a shell command line, so flags
+// with quotes or spaces reach it unchanged.
+// <object>.cmd next to every object holds the arguments it was built with, an object older than its source or built
+// with other arguments is compiled again.
+class CCompiler {
+	struct Job {
+		std::filesystem::path c_path;
+		std::filesystem::path obj_path;
+		luisa::vector<luisa::string> args;
+		vstd::function<void(bool)> done;
+	};
+	std::mutex _mtx;
+	std::condition_variable _cv;
+	std::condition_variable _idle_cv;
+	std::deque<Job> _jobs;
+	size_t _running{};
+	bool _exit{};
+	luisa::vector<std::thread> _threads;
+
+#ifdef _WIN32
+	// quoting of CommandLineToArgvW and the C runtime
+	static void append_quoted(luisa::string& cmd, luisa::string const& arg) {
+		if (!arg.empty() && arg.find_first_of(" \t\n\v\"") == luisa::string::npos) {
+			cmd += arg;
+			return;
+		}
+		cmd += '"';
+		for (auto iter = arg.begin();; ++iter) {
+			size_t backslashes = 0;
+			while (iter != arg.end() && *iter == '\\') {
+				++iter;
+				++backslashes;
+			}
+			if (iter == arg.end()) {
+				cmd.append(backslashes * 2, '\\');
+				break;
+			}
+			if (*iter == '"') {
+				cmd.append(backslashes * 2 + 1, '\\');
+			} else {
+				cmd.append(backslashes, '\\');
+			}
+			cmd += *iter;
+		}
+		cmd += '"';
+	}
+#endif
+	static bool run_process(luisa::vector<luisa::string> const& args) {
+#ifdef _WIN32
+		luisa::string cmd;
+		for (auto& i : args) {
+			if (!cmd.empty()) cmd += ' ';
+			append_quoted(cmd, i);
+		}
+		STARTUPINFOA startup_info{};
+		startup_info.cb = sizeof(startup_info);
+		PROCESS_INFORMATION process_info{};
+		if (!CreateProcessA(nullptr, cmd.data(), nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startup_info, &process_info)) {
+			LUISA_WARNING("Start C compiler '{}' failed.", args[0]);
+			return false;
+		}
+		WaitForSingleObject(process_info.hProcess, INFINITE);
+		DWORD exit_code = 1;
+		GetExitCodeProcess(process_info.hProcess, &exit_code);
+		CloseHandle(process_info.hThread);
+		CloseHandle(process_info.hProcess);
+		return exit_code == 0;
+#else
+		luisa::vector<char*> argv;
+		argv.reserve(args.size() + 1);
+		for (auto& i : args) {
+			argv.emplace_back(const_cast<char*>(i.c_str()));
+		}
+		argv.emplace_back(nullptr);
+		pid_t pid;
+		if (posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0) {
+			LUISA_WARNING("Start C compiler '{}' failed.", args[0]);
+			return false;
+		}
+		int status;
+		while (waitpid(pid, &status, 0) < 0) {
+			if (errno != EINTR) return false;
+		}
+		return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#endif
+	}
+	static luisa::string command_key(luisa::vector<luisa::string> const& args) {
+		luisa::string key;
+		for (auto& i : args) {
+			key += i;
+			key += '\n';
+		}
+		return key;
+	}
+	static bool up_to_date(Job const& job, luisa::string const& key) {
+		std::error_code ec;
+		auto obj_time = std::filesystem::last_write_time(job.obj_path, ec);
+		if (ec || obj_time < std::filesystem::last_write_time(job.c_path, ec) || ec) {
+			return false;
+		}
+		auto cmd_path = job.obj_path;
+		cmd_path += ".cmd";
+		luisa::string data;
+		return read_file(cmd_path, data) && data == key;
+	}
+	static bool compile(Job const& job) {
+		auto key = command_key(job.args);
+		if (up_to_date(job, key)) {
+			return true;
+		}
+		auto cmd_path = job.obj_path;
+		cmd_path += ".cmd";
+		std::error_code ec;
+		// an interrupted compile must not leave a matching command behind
+		std::filesystem::remove(cmd_path, ec);
+		LUISA_INFO("compiling {}", luisa::to_string(job.c_path.filename()));
+		if (!run_process(job.args)) {
+			std::filesystem::remove(job.obj_path, ec);
+			return false;
+		}
+		auto f = fopen(luisa::to_string(cmd_path).c_str(), "wb");
+		if (f) {
+			fwrite(key.data(), 1, key.size(), f);
+			fclose(f);
+		}
+		return true;
+	}
+	void worker() {
+		std::unique_lock lck{_mtx};
+		while (true) {
+			_cv.wait(lck, [&] { return _exit || !_jobs.empty(); });
+			if (_jobs.empty()) return;
+			auto job = std::move(_jobs.front());
+			_jobs.pop_front();
+			++_running;
+			lck.unlock();
+			job.done(compile(job));
+			lck.lock();
+			--_running;
+			if (_jobs.empty() && _running == 0) {
+				_idle_cv.notify_all();
+			}
+		}
+	}
+
+public:
+	CCompiler() {
+		auto count = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+		_threads.reserve(count);
+		for (size_t i = 0; i < count; ++i) {
+			_threads.emplace_back([this] { worker(); });
+		}
+	}
+	CCompiler(CCompiler const&) = delete;
+	CCompiler& operator=(CCompiler const&) = delete;
+	~CCompiler() {
+		{
+			std::lock_guard lck{_mtx};
+			_exit = true;
+		}
+		_cv.notify_all();
+		for (auto& i : _threads) {
+			i.join();
+		}
+	}
+	// args is the whole command line, starting with the compiler; done runs on a compile thread
+	void submit(std::filesystem::path c_path, std::filesystem::path obj_path, luisa::vector<luisa::string> args, vstd::function<void(bool)> done) {
+		{
+			std::lock_guard lck{_mtx};
+			_jobs.emplace_back(Job{std::move(c_path), std::move(obj_path), std::move(args), std::move(done)});
+		}
+		_cv.notify_one();
+	}
+	// blocks until every submitted compile is done
+	void wait() {
+		std::unique_lock lck{_mtx};
+		_idle_cv.wait(lck, [&] { return _jobs.empty() && _running == 0; });
+	}
+};
@@ -0,0 +1,874 @@
+#pragma once
+#include <luisa/core/fiber.h>
+#include <luisa/core/logging.h>
+#include <luisa/core/stl/filesystem.h>
+#include <luisa/core/stl/hash.h>
+#include <luisa/core/stl/memory.h>
+#include <luisa/core/stl/string.h>
+#include <luisa/core/stl/unordered_map.h>
+#include <luisa/core/stl/vector.h>
+#include <luisa/core/stl/pdqsort.h>
+#include <luisa/vstl/common.h>
+#include "utils.h"
+#include <mutex>
+
+// Moves static functions defined identically by several generated C files into shared common_*.c files.
+// Every file is split into top level items by a small C scanner. A static function is shared when at least two files
+// with the same preprocessor lines define it with the same tokens, and everything it references is either another
+// shared function or a type / extern declaration that is identical in all of those files.
+// Shared functions get a unique external name with hidden visibility, the files keep a prototype and call the renamed
+// function. Without LTO the C compiler can no longer inline them into their callers, sharing trades speed for size.
+// Static functions that no exported function, variable or constructor, destructor or used function reaches can be
+// dropped, so the C compiler never parses them.
+// The same pass can mark exported functions for multiversioning, the C compiler then builds one clone per ISA
+// and the dynamic loader picks the best one for the CPU when the symbol is resolved.
+// Static functions are left alone: a clone can not be inlined, and inlining is how the static helpers of a kernel get
+// compiled for the ISA of the calling clone.
+class FunctionDedup {
+public:
+	struct Settings {
+		// move identical static functions into common_*.c, calls to them are not inlined without LTO
+		bool share{true};
+		// options the generated code depends on, written into every output
+		luisa::string_view option_key;
+		// target_clones list for exported functions, E.g "avx2", "default". empty to build them for one ISA
+		luisa::string_view target_clones;
+		// drop static functions no exported function or variable reaches, and their prototypes
+		bool strip_dead{};
+	};
+	struct Output {
+		std::filesystem::path path;
+		// false if the file already had this content, its object from the last build can be reused
+		bool changed;
+	};
+	struct FunctionInfo {
+		luisa::string name;
+		// "file:line" of the #line marker in front of the definition, empty without one
+		luisa::string origin;
+		bool is_static;
+		size_t tokens;
+		size_t bytes;
+	};
+
+private:
+	static constexpr size_t functions_per_common_file = 256;
+	static constexpr uint64_t symbol_seed = 0x6a09e667f3bcc909ull;
+	enum class TokenKind : uint8_t {
+		Identifier,
+		Directive,
+		Punct,
+		Other
+	};
+	struct Token {
+		luisa::string_view text;
+		TokenKind kind;
+	};
+	enum class ItemKind : uint8_t {
+		Directive,
+		// function definition
+		Function,
+		// function declaration
+		Prototype,
+		// typedef, struct, union or enum
+		Type,
+		Extern,
+		// variables and everything else
+		Other
+	};
+	struct Item {
+		ItemKind kind;
+		bool is_static{};
+		size_t begin{};
+		size_t end{};
+		// '{' of a function definition
+		size_t body{};
+		luisa::string name;
+		// tokens joined by spaces
+		luisa::string key;
+		// identifiers used by the item, except member names
+		luisa::vector<luisa::string_view> refs;
+		// index into _groups for function definitions
+		size_t group{~0ull};
+		// function reachable from a non-static function or a variable, others are dropped by the C compiler anyway
+		bool live{};
+		// static function the C compiler keeps although nothing calls it, see has_keep_attribute()
+		bool kept{};
+		// #line directive right before the item, a shared definition takes it to the common file
+		size_t line_directive{~0ull};
+	};
+	struct File {
+		std::filesystem::path path;
+		luisa::string source;
+		luisa::vector<Token> tokens;
+		luisa::vector<Item> items;
+		luisa::string prelude;
+		// declarations inside #if blocks, the prelude can not be copied on its own then
+		bool conditional{};
+		luisa::unordered_map<luisa::string, size_t> functions;
+		// declarations of everything else, a struct may be declared several times
+		luisa::unordered_map<luisa::string, luisa::vector<size_t>> symbols;
+		luisa::unordered_map<luisa::string, luisa::string> renames;
+		// keys of the types and declarations an item depends on, empty if it can not be copied
+		luisa::unordered_map<size_t, luisa::string> closures;
+	};
+	struct Group {
+		luisa::vector<std::pair<size_t, size_t>> instances;
+		luisa::string symbol;
+		luisa::string prelude;
+		bool shared{true};
+	};
+	// heap allocated, the tokens point into the source of their file
+	luisa::vector<luisa::unique_ptr<File>> _files;
+	std::mutex _files_mtx;
+	luisa::vector<Group> _groups;
+
+	static bool is_keyword(luisa::string_view name) {
+		static constexpr luisa::string_view keywords[] = {
+			"auto", "bool", "break", "case", "char", "const", "continue", "default", "do", "double", "else", "enum", "extern",
+			"float", "for", "goto", "if", "inline", "int", "long", "register", "restrict", "return", "short", "signed",
+			"sizeof", "static", "struct", "switch", "typedef", "union", "unsigned", "void", "volatile", "while",
+			"_Alignas", "_Alignof", "_Atomic", "_Bool", "_Noreturn", "_Static_assert", "_Thread_local", "alignas",
+			"__attribute__", "__declspec", "__inline", "__forceinline", "__restrict"};
+		for (auto i : keywords) {
+			if (i == name) return true;
+		}
+		return false;
+	}
+	static bool is_attribute(luisa::string_view name) {
+		return name == "__attribute__" || name == "__declspec" || name == "_Alignas" || name == "alignas";
+	}
+	static bool is_ident_char(char c) {
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+	}
+	static void tokenize(File& file) {
+		auto& src = file.source;
+		size_t i = 0;
+		bool line_start = true;
+		auto push = [&](size_t begin, TokenKind kind) {
+			file.tokens.emplace_back(Token{luisa::string_view{src.data() + begin, i - begin}, kind});
+		};
+		while (i < src.size()) {
+			auto c = src[i];
+			if (c == '\n') {
+				line_start = true;
+				++i;
+				continue;
+			}
+			if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+				++i;
+				continue;
+			}
+			if (c == '/' && i + 1 < src.size() && src[i + 1] == '/') {
+				while (i < src.size() && src[i] != '\n') ++i;
+				continue;
+			}
+			if (c == '/' && i + 1 < src.size() && src[i + 1] == '*') {
+				auto end = src.find("*/", i + 2);
+				i = end == luisa::string::npos ? src.size() : end + 2;
+				continue;
+			}
+			auto begin = i;
+			if (c == '#' && line_start) {
+				while (i < src.size() && src[i] != '\n') {
+					if (src[i] == '\\' && i + 1 < src.size() && (src[i + 1] == '\n' || src[i + 1] == '\r')) {
+						i += src[i + 1] == '\r' && i + 2 < src.size() && src[i + 2] == '\n' ? 3 : 2;
+						continue;
+					}
+					++i;
+				}
+				while (i > begin && (src[i - 1] == '\r' || src[i - 1] == ' ' || src[i - 1] == '\t')) --i;
+				push(begin, TokenKind::Directive);
+				continue;
+			}
+			line_start = false;
+			if (is_ident_char(c) && !(c >= '0' && c <= '9')) {
+				while (i < src.size() && is_ident_char(src[i])) ++i;
+				push(begin, TokenKind::Identifier);
+			} else if ((c >= '0' && c <= '9') || (c == '.' && i + 1 < src.size() && src[i + 1] >= '0' && src[i + 1] <= '9')) {
+				while (i < src.size()) {
+					auto d = src[i];
+					if ((d == '+' || d == '-') && (src[i - 1] == 'e' || src[i - 1] == 'E' || src[i - 1] == 'p' || src[i - 1] == 'P')) {
+						++i;
+					} else if (is_ident_char(d) || d == '.') {
+						++i;
+					} else {
+						break;
+					}
+				}
+				push(begin, TokenKind::Other);
+			} else if (c == '"' || c == '\'') {
+				++i;
+				while (i < src.size() && src[i] != c && src[i] != '\n') {
+					i += src[i] == '\\' ? 2 : 1;
+				}
+				i = std::min(i + 1, src.size());
+				push(begin, TokenKind::Other);
+			} else {
+				// longest punctuator first, the key of "a+ ++b" must differ from "a++ +b"
+				static constexpr luisa::string_view punctuators[] = {
+					"<<=", ">>=", "...", "->", "++", "--", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||",
+					"+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", "##"};
+				auto rest = luisa::string_view{src}.substr(i);
+				size_t size = 1;
+				for (auto p : punctuators) {
+					if (rest.starts_with(p)) {
+						size = p.size();
+						break;
+					}
+				}
+				i += size;
+				push(begin, TokenKind::Punct);
+			}
+		}
+	}
+	static bool is(File const& file, size_t idx, char c) {
+		auto& t = file.tokens[idx];
+		return t.kind == TokenKind::Punct && t.text.size() == 1 && t.text[0] == c;
+	}
+	// matching close bracket of the open bracket at idx, or end
+	static size_t skip_group(File const& file, size_t idx, size_t end) {
+		size_t depth = 0;
+		for (; idx < end; ++idx) {
+			if (is(file, idx, '(') || is(file, idx, '[') || is(file, idx, '{')) {
+				++depth;
+			} else if (is(file, idx, ')') || is(file, idx, ']') || is(file, idx, '}')) {
+				if (--depth == 0) return idx;
+			}
+		}
+		return end;
+	}
+	// first top level parameter list of a declaration, preceded by the declared name
+	static size_t find_parameters(File const& file, size_t begin, size_t end) {
+		for (auto i = begin; i < end; ++i) {
+			if (is(file, i, '=') || is(file, i, '{')) return end;
+			if (!is(file, i, '(') && !is(file, i, '[')) continue;
+			if (is(file, i, '(') && i > begin) {
+				auto& prev = file.tokens[i - 1];
+				if (prev.kind == TokenKind::Identifier && !is_keyword(prev.text)) {
+					return i;
+				}
+			}
+			i = skip_group(file, i, end);
+		}
+		return end;
+	}
+	static void add_item(File& file, size_t begin, size_t end, size_t body) {
+		auto& item = file.items.emplace_back();
+		item.begin = begin;
+		item.end = end;
+		item.body = body;
+		auto& first = file.tokens[begin].text;
+		for (auto i = begin; i < end; ++i) {
+			auto& t = file.tokens[i];
+			if (i > begin) item.key += ' ';
+			item.key += t.text;
+			if (t.kind == TokenKind::Identifier && t.text == "static" && (body == 0 || i < body)) {
+				item.is_static = true;
+			}
+			if (t.kind == TokenKind::Identifier && !is_keyword(t.text) && !(i > begin && (is(file, i - 1, '.') || file.tokens[i - 1].text == "->"))) {
+				item.refs.emplace_back(t.text);
+			}
+		}
+		auto declare = [&](luisa::string_view name) {
+			auto& items = file.symbols[luisa::string{name}];
+			if (items.empty() || items.back() != file.items.size() - 1) {
+				items.emplace_back(file.items.size() - 1);
+			}
+		};
+		if (body != 0) {
+			auto params = find_parameters(file, begin, body);
+			if (params < body) {
+				item.kind = ItemKind::Function;
+				item.name = file.tokens[params - 1].text;
+				file.functions.try_emplace(item.name, file.items.size() - 1);
+			} else {
+				item.kind = ItemKind::Other;
+			}
+			return;
+		}
+		auto params = find_parameters(file, begin, end);
+		if (first != "typedef" && params < end) {
+			auto close = skip_group(file, params, end);
+			if (close + 1 < end && (is(file, close + 1, ';') || file.tokens[close + 1].text == "__attribute__")) {
+				item.kind = first == "extern" ? ItemKind::Extern : ItemKind::Prototype;
+				item.name = file.tokens[params - 1].text;
+				declare(item.name);
+				return;
+			}
+		}
+		if (first == "extern") {
+			item.kind = ItemKind::Extern;
+		} else if (first == "typedef" || ((first == "struct" || first == "union" || first == "enum") && (end - begin == 3 || item.key.find('{') != luisa::string::npos))) {
+			item.kind = ItemKind::Type;
+		} else {
+			item.kind = ItemKind::Other;
+		}
+		// declared names are followed by a declarator end and tags follow their keyword,
+		// inside braces only enumerators are declared, struct members are not
+		size_t depth = 0;
+		bool in_enum = false;
+		for (auto i = begin; i + 1 < end; ++i) {
+			auto& t = file.tokens[i];
+			if (is(file, i, '{')) {
+				if (depth++ == 0) {
+					in_enum = (i > begin && file.tokens[i - 1].text == "enum") || (i > begin + 1 && file.tokens[i - 2].text == "enum");
+				}
+				continue;
+			}
+			if (is(file, i, '}')) {
+				if (depth > 0) --depth;
+				continue;
+			}
+			if (t.kind != TokenKind::Identifier || is_keyword(t.text) || (depth > 0 && !in_enum)) continue;
+			auto& prev = file.tokens[i > begin ? i - 1 : i];
+			if (i > begin && (prev.text == "struct" || prev.text == "union" || prev.text == "enum")) {
+				declare(t.text);
+			} else if (is(file, i + 1, ';') || is(file, i + 1, ',') || is(file, i + 1, ')') || is(file, i + 1, '[') || is(file, i + 1, '=') || is(file, i + 1, '}')) {
+				declare(t.text);
+			}
+		}
+	}
+	static void split_items(File& file) {
+		size_t depth = 0;
+		size_t item_begin = 0;
+		size_t open_brace = 0;
+		bool initializer = false;
+		size_t if_depth = 0;
+		size_t line_directive = ~0ull;
+		auto& tokens = file.tokens;
+		auto add = [&](size_t begin, size_t end, size_t body) {
+			add_item(file, begin, end, body);
+			file.items.back().line_directive = line_directive;
+			line_directive = ~0ull;
+		};
+		for (size_t i = 0; i < tokens.size(); ++i) {
+			if (depth == 0 && i == item_begin && tokens[i].kind == TokenKind::Directive) {
+				auto& item = file.items.emplace_back();
+				item.kind = ItemKind::Directive;
+				item.begin = i;
+				item.end = i + 1;
+				item_begin = i + 1;
+				auto directive = tokens[i].text.substr(1);
+				directive.remove_prefix(std::min(directive.find_first_not_of(" \t"), directive.size()));
+				// line markers only point at the script source, they do not change the code
+				if (directive.starts_with("line") || (!directive.empty() && directive[0] >= '0' && directive[0] <= '9')) {
+					line_directive = file.items.size() - 1;
+					continue;
+				}
+				line_directive = ~0ull;
+				file.prelude += tokens[i].text;
+				file.prelude += '\n';
+				if (directive.starts_with("if")) {
+					++if_depth;
+				} else if (directive.starts_with("endif") && if_depth > 0) {
+					--if_depth;
+				}
+				continue;
+			}
+			if (i == item_begin && if_depth > 0) {
+				file.conditional = true;
+			}
+			if (depth == 0 && is(file, i, '=')) {
+				initializer = true;
+			}
+			if (is(file, i, '(') || is(file, i, '[') || is(file, i, '{')) {
+				if (depth == 0 && is(file, i, '{')) open_brace = i;
+				++depth;
+			} else if (is(file, i, ')') || is(file, i, ']') || is(file, i, '}')) {
+				if (depth > 0) --depth;
+				// a body after a parameter list ends a function definition, other braces belong to types and initializers
+				if (depth == 0 && is(file, i, '}') && !initializer && open_brace > item_begin && is(file, open_brace - 1, ')')) {
+					auto group_begin = open_brace - 1;
+					for (size_t d = 0; group_begin > item_begin; --group_begin) {
+						if (is(file, group_begin, ')')) ++d;
+						if (is(file, group_begin, '(') && --d == 0) break;
+					}
+					auto& name = tokens[group_begin > item_begin ? group_begin - 1 : item_begin];
+					auto first = tokens[item_begin].text;
+					bool type_first = first == "typedef" || first == "struct" || first == "union" || first == "enum";
+					if (group_begin > item_begin && name.kind == TokenKind::Identifier && (!type_first || !is_attribute(name.text))) {
+						add(item_begin, i + 1, open_brace);
+						item_begin = i + 1;
+						initializer = false;
+					}
+				}
+			} else if (depth == 0 && is(file, i, ';')) {
+				add(item_begin, i + 1, 0);
+				item_begin = i + 1;
+				initializer = false;
+			}
+		}
+		if (item_begin < tokens.size()) {
+			add(item_begin, tokens.size(), 0);
+			file.items.back().kind = ItemKind::Other;
+		}
+	}
+	// __attribute__((constructor)), destructor or used on a declaration
+	static bool has_keep_attribute(File const& file, Item const& item) {
+		auto end = item.kind == ItemKind::Function ? item.body : item.end;
+		for (auto i = item.begin; i < end; ++i) {
+			if (file.tokens[i].text != "__attribute__") continue;
+			auto group_end = skip_group(file, i + 1, end);
+			for (auto j = i + 1; j < group_end; ++j) {
+				auto name = file.tokens[j].text;
+				if (name == "constructor" || name == "destructor" || name == "used" ||
+					name == "__constructor__" || name == "__destructor__" || name == "__used__") {
+					return true;
+				}
+			}
+			i = group_end;
+		}
+		return false;
+	}
+	static void mark_live(File& file) {
+		// the attribute may be on a prototype, it applies to the definition
+		for (auto& item : file.items) {
+			if ((item.kind != ItemKind::Function && item.kind != ItemKind::Prototype) || !item.is_static || !has_keep_attribute(file, item)) continue;
+			if (auto iter = file.functions.find(item.name); iter != file.functions.end()) {
+				file.items[iter->second].kept = true;
+			}
+		}
+		luisa::vector<size_t> stack;
+		for (auto idx : vstd::range(file.items.size())) {
+			auto& item = file.items[idx];
+			if ((item.kind == ItemKind::Function && (!item.is_static || item.kept)) || item.kind == ItemKind::Other) {
+				item.live = true;
+				stack.emplace_back(idx);
+			}
+		}
+		while (!stack.empty()) {
+			auto idx = stack.back();
+			stack.pop_back();
+			for (auto ref_name : file.items[idx].refs) {
+				auto iter = file.functions.find(luisa::string{ref_name});
+				if (iter == file.functions.end() || file.items[iter->second].live) continue;
+				file.items[iter->second].live = true;
+				stack.emplace_back(iter->second);
+			}
+		}
+	}
+	// what a name used by item self refers to: another function definition, or the closures of all declarations of it
+	struct Reference {
+		size_t function{~0ull};
+		luisa::string closure;
+		// false if a declaration of it can not be copied into a common file
+		bool valid{true};
+	};
+	Reference reference(File& file, luisa::string_view name, size_t self) {
+		Reference r;
+		luisa::string key{name};
+		if (auto iter = file.functions.find(key); iter != file.functions.end()) {
+			if (iter->second != self) {
+				r.function = iter->second;
+			}
+			return r;
+		}
+		if (auto iter = file.symbols.find(key); iter != file.symbols.end()) {
+			for (auto dep : iter->second) {
+				if (dep == self) continue;
+				auto c = closure(file, dep);
+				if (c.empty()) {
+					r.valid = false;
+					return r;
+				}
+				r.closure += c;
+				r.closure += '\n';
+			}
+		}
+		return r;
+	}
+	// types and declarations can be copied into the common files if they only depend on each other
+	luisa::string closure(File& file, size_t idx) {
+		if (auto iter = file.closures.find(idx); iter != file.closures.end()) {
+			return iter->second;
+		}
+		auto& item = file.items[idx];
+		// breaks cycles of self referencing types
+		file.closures.try_emplace(idx, item.key);
+		bool copyable = item.kind == ItemKind::Type || item.kind == ItemKind::Extern ||
+						(item.kind == ItemKind::Prototype && !item.is_static && file.functions.find(item.name) == file.functions.end());
+		luisa::string r;
+		if (copyable) {
+			for (auto ref_name : item.refs) {
+				auto ref = reference(file, ref_name, idx);
+				if (!ref.valid || ref.function != ~0ull) {
+					copyable = false;
+					break;
+				}
+				r += ref.closure;
+			}
+		}
+		if (!copyable) {
+			r.clear();
+		} else {
+			r += item.key;
+		}
+		file.closures[idx] = r;
+		return r;
+	}
+	bool check_group(Group& group) {
+		auto [rep_file, rep_item] = group.instances[0];
+		auto& refs = _files[rep_file]->items[rep_item].refs;
+		for (auto ref_name : refs) {
+			size_t dep_group = ~0ull;
+			luisa::string dep_closure;
+			bool first = true;
+			for (auto [file_idx, item_idx] : group.instances) {
+				auto& file = *_files[file_idx];
+				auto ref = reference(file, ref_name, item_idx);
+				if (!ref.valid) return false;
+				size_t g = ~0ull;
+				if (ref.function != ~0ull) {
+					g = file.items[ref.function].group;
+					if (g == ~0ull || !_groups[g].shared) return false;
+				}
+				if (first) {
+					dep_group = g;
+					dep_closure = std::move(ref.closure);
+					first = false;
+				} else if (g != dep_group || ref.closure != dep_closure) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+	void collect_copyable(File const& file, size_t idx, luisa::vector<bool>& needed) const {
+		if (needed[idx]) return;
+		needed[idx] = true;
+		for (auto ref_name : file.items[idx].refs) {
+			luisa::string key{ref_name};
+			if (file.functions.find(key) != file.functions.end()) continue;
+			if (auto iter = file.symbols.find(key); iter != file.symbols.end()) {
+				for (auto dep : iter->second) {
+					collect_copyable(file, dep, needed);
+				}
+			}
+		}
+	}
+	// item text with shared functions renamed, strip removes static and inline before the function body
+	void emit(File const& file, Item const& item, size_t end, bool strip, bool rename, luisa::string& out) const {
+		auto src_begin = file.source.data();
+		size_t last = ~0ull;
+		for (auto i = item.begin; i < end; ++i) {
+			auto& t = file.tokens[i];
+			auto pos = static_cast<size_t>(t.text.data() - src_begin);
+			if (last != ~0ull) {
+				out.append(src_begin + last, pos - last);
+			}
+			last = pos + t.text.size();
+			if (t.kind == TokenKind::Identifier) {
+				if (strip && (item.kind != ItemKind::Function || i < item.body) &&
+					(t.text == "static" || t.text == "inline" || t.text == "__inline" || t.text == "__forceinline")) {
+					while (last < file.source.size() && (file.source[last] == ' ' || file.source[last] == '\t')) ++last;
+					continue;
+				}
+				if (rename && !(i > item.begin && (is(file, i - 1, '.') || file.tokens[i - 1].text == "->"))) {
+					if (auto iter = file.renames.find(luisa::string{t.text}); iter != file.renames.end()) {
+						out += iter->second;
+						continue;
+					}
+				}
+			}
+			out += t.text;
+		}
+	}
+	// prototype of a shared function, they are only called by the generated files of one target
+	void emit_prototype(File const& file, Item const& item, luisa::string& out) const {
+		out += "LUISA_SHARED ";
+		auto start = out.size();
+		emit(file, item, item.kind == ItemKind::Function ? item.body : item.end - 1, true, true, out);
+		while (out.size() > start && (out.back() == ' ' || out.back() == '\n' || out.back() == '\t' || out.back() == '\r')) {
+			out.pop_back();
+		}
+		out += ";\n";
+	}
+	static bool write_if_changed(std::filesystem::path const& path, luisa::string const& data) {
+		luisa::string old_data;
+		if (read_file(path, old_data) && old_data == data) {
+			return false;
+		}
+		auto path_str = luisa::to_string(path);
+		auto f = fopen(path_str.c_str(), "wb");
+		if (!f || fwrite(data.data(), 1, data.size(), f) != data.size()) [[unlikely]] {
+			LUISA_ERROR("Write {} failed.", path_str);
+		}
+		fclose(f);
+		return true;
+	}
+	static void load(File& file, std::filesystem::path const& path) {
+		file.path = path;
+		if (!read_file(file.path, file.source)) [[unlikely]] {
+			LUISA_ERROR("Read generated file {} failed.", luisa::to_string(file.path));
+		}
+		tokenize(file);
+		split_items(file);
+		mark_live(file);
+	}
+	// ifunc based multiversioning only exists for GCC and Clang on ELF targets
+	static luisa::string clones_macro(Settings const& settings) {
+		if (settings.target_clones.empty()) return {};
+		return luisa::format(
+			"#if (defined(__GNUC__) || defined(__clang__)) && defined(__ELF__) && (defined(__x86_64__) || defined(__i386__))\n"
+			"#define LUISA_TARGET_CLONES __attribute__((target_clones({})))\n"
+			"#else\n"
+			"#define LUISA_TARGET_CLONES\n"
+			"#endif\n",
+			settings.target_clones);
+	}
+	static constexpr luisa::string_view shared_macro =
+		"#if (defined(__GNUC__) || defined(__clang__)) && !defined(_WIN32)\n"
+		"#define LUISA_SHARED __attribute__((visibility(\"hidden\")))\n"
+		"#else\n"
+		"#define LUISA_SHARED\n"
+		"#endif\n";
+	// <name>.dedup.c of one file, with its shared functions replaced by prototypes
+	Output write_output(File const& file, Settings const& settings, luisa::string_view clones) const {
+		luisa::string out;
+		out.reserve(file.source.size());
+		out += "// ";
+		out += settings.option_key;
+		out += '\n';
+		out += clones;
+		if (!file.renames.empty()) {
+			out += shared_macro;
+		}
+		for (auto& item : file.items) {
+			if (settings.strip_dead && !file.conditional && (item.kind == ItemKind::Function || item.kind == ItemKind::Prototype) && item.is_static) {
+				auto iter = file.functions.find(item.name);
+				if (iter != file.functions.end() && !file.items[iter->second].live) continue;
+			}
+			if ((item.kind == ItemKind::Function || item.kind == ItemKind::Prototype) && file.renames.find(item.name) != file.renames.end()) {
+				emit_prototype(file, item, out);
+				continue;
+			}
+			if (item.kind == ItemKind::Function && !item.is_static && !clones.empty()) {
+				out += "LUISA_TARGET_CLONES ";
+			}
+			emit(file, item, item.end, false, item.kind != ItemKind::Type && item.kind != ItemKind::Directive, out);
+			out += '\n';
+		}
+		auto out_path = file.path;
+		out_path.replace_extension(".dedup.c");
+		bool changed = write_if_changed(out_path, out);
+		return Output{std::move(out_path), changed};
+	}
+
+public:
+	// Top level function definitions of a generated C file, in file order.
+	static luisa::vector<FunctionInfo> scan(std::filesystem::path const& path) {
+		File file;
+		file.path = path;
+		if (!read_file(file.path, file.source)) [[unlikely]] {
+			LUISA_ERROR("Read generated file {} failed.", luisa::to_string(file.path));
+		}
+		tokenize(file);
+		split_items(file);
+		luisa::vector<FunctionInfo> result;
+		for (auto& item : file.items) {
+			if (item.kind != ItemKind::Function) continue;
+			auto& info = result.emplace_back();
+			info.name = item.name;
+			info.is_static = item.is_static;
+			info.tokens = item.end - item.begin;
+			auto& last = file.tokens[item.end - 1].text;
+			info.bytes = static_cast<size_t>(last.data() + last.size() - file.tokens[item.begin].text.data());
+			if (item.line_directive == ~0ull) continue;
+			// #line 12 "file" or # 12 "file"
+			auto directive = file.tokens[file.items[item.line_directive].begin].text.substr(1);
+			directive.remove_prefix(std::min(directive.find_first_not_of(" \t"), directive.size()));
+			if (directive.starts_with("line")) {
+				directive.remove_prefix(4);
+				directive.remove_prefix(std::min(directive.find_first_not_of(" \t"), directive.size()));
+			}
+			auto number = directive.substr(0, std::min(directive.find_first_of(" \t"), directive.size()));
+			auto quote = directive.find('"');
+			if (quote != luisa::string_view::npos) {
+				auto name = directive.substr(quote + 1);
+				info.origin = name.substr(0, std::min(name.find('"'), name.size()));
+			}
+			info.origin += ':';
+			info.origin += number;
+		}
+		return result;
+	}
+	// Rewrites one generated file on its own, enough for strip_dead and target_clones without share.
+	// Can run on any fiber right after the file is generated.
+	Output run_single(std::filesystem::path const& source, Settings const& settings) const {
+		File file;
+		load(file, source);
+		return write_output(file, settings, clones_macro(settings));
+	}
+	// Reads and scans a generated file for run(), can be called from several fibers while the others are still generated.
+	void add(std::filesystem::path const& source) {
+		auto file = luisa::make_unique<File>();
+		load(*file, source);
+		std::lock_guard lck{_files_mtx};
+		_files.emplace_back(std::move(file));
+	}
+	// Writes <name>.dedup.c for every added file and common_*.c into common_dir.
+	luisa::vector<Output> run(std::filesystem::path const& common_dir, Settings const& settings) {
+		_groups.clear();
+		// the files arrive in generation order, symbols and common files must not depend on it
+		pdqsort(_files.begin(), _files.end(), [](auto const& a, auto const& b) { return a->path < b->path; });
+		// group identical static functions of files with the same preprocessor lines and the same types
+		luisa::unordered_map<luisa::string, size_t> group_indices;
+		for (auto file_idx : vstd::range(_files.size())) {
+			auto& file = *_files[file_idx];
+			for (auto item_idx : vstd::range(file.items.size())) {
+				auto& item = file.items[item_idx];
+				// a kept function runs or stays once per file, it can not be shared
+				if (!settings.share || file.conditional || item.kind != ItemKind::Function || !item.is_static || !item.live || item.kept || file.functions[item.name] != item_idx) continue;
+				luisa::string key = file.prelude;
+				key += '\0';
+				key += item.key;
+				bool valid = true;
+				for (auto ref_name : item.refs) {
+					auto ref = reference(file, ref_name, item_idx);
+					if (!ref.valid) {
+						valid = false;
+						break;
+					}
+					key += '\0';
+					key += ref.closure;
+				}
+				if (!valid) continue;
+				auto iter = group_indices.try_emplace(std::move(key), _groups.size());
+				if (iter.second) {
+					auto& group = _groups.emplace_back();
+					group.prelude = file.prelude;
+					group.symbol = luisa::format("{}_s{:016x}", item.name, luisa::hash64(iter.first->first.data(), iter.first->first.size(), symbol_seed));
+				}
+				item.group = iter.first->second;
+				_groups[item.group].instances.emplace_back(file_idx, item_idx);
+			}
+		}
+		for (auto& group : _groups) {
+			group.shared = group.instances.size() >= 2;
+		}
+		for (bool changed = true; changed;) {
+			changed = false;
+			for (auto& group : _groups) {
+				if (group.shared && !check_group(group)) {
+					group.shared = false;
+					changed = true;
+				}
+			}
+		}
+		luisa::vector<size_t> shared;
+		for (auto i : vstd::range(_groups.size())) {
+			auto& group = _groups[i];
+			if (!group.shared) continue;
+			shared.emplace_back(i);
+			for (auto [file_idx, item_idx] : group.instances) {
+				auto& file = *_files[file_idx];
+				file.renames.try_emplace(file.items[item_idx].name, group.symbol);
+			}
+		}
+		pdqsort(shared.begin(), shared.end(), [&](size_t a, size_t b) {
+			auto& ga = _groups[a];
+			auto& gb = _groups[b];
+			if (ga.prelude != gb.prelude) return ga.prelude < gb.prelude;
+			return ga.symbol < gb.symbol;
+		});
+		auto clones = clones_macro(settings);
+		luisa::vector<Output> outputs;
+		outputs.resize(_files.size());
+		luisa::fiber::parallel(_files.size(), [&](size_t file_idx) {
+			outputs[file_idx] = write_output(*_files[file_idx], settings, clones);
+		});
+		// each common file holds up to functions_per_common_file definitions of one preprocessor line set,
+		// with the types and prototypes of all shared functions of that set
+		size_t common_idx = 0;
+		for (size_t begin = 0; begin < shared.size();) {
+			auto& prelude = _groups[shared[begin]].prelude;
+			auto set_end = begin;
+			while (set_end < shared.size() && _groups[shared[set_end]].prelude == prelude) ++set_end;
+			luisa::string header = "// functions shared by several generated files, ";
+			header += settings.option_key;
+			header += '\n';
+			header += clones;
+			header += shared_macro;
+			header += prelude;
+			// copied types keep the order of the file they come from, a type needed by several files is copied once
+			luisa::vector<size_t> type_files;
+			for (auto i = begin; i < set_end; ++i) {
+				auto file_idx = _groups[shared[i]].instances[0].first;
+				if (std::find(type_files.begin(), type_files.end(), file_idx) == type_files.end()) {
+					type_files.emplace_back(file_idx);
+				}
+			}
+			luisa::unordered_map<luisa::string, bool> emitted;
+			for (auto type_file : type_files) {
+				auto& file = *_files[type_file];
+				luisa::vector<bool> needed(file.items.size(), false);
+				for (auto i = begin; i < set_end; ++i) {
+					auto [file_idx, item_idx] = _groups[shared[i]].instances[0];
+					if (file_idx != type_file) continue;
+					for (auto ref_name : file.items[item_idx].refs) {
+						luisa::string key{ref_name};
+						if (file.functions.find(key) != file.functions.end()) continue;
+						if (auto iter = file.symbols.find(key); iter != file.symbols.end()) {
+							for (auto dep : iter->second) {
+								collect_copyable(file, dep, needed);
+							}
+						}
+					}
+				}
+				for (auto idx : vstd::range(file.items.size())) {
+					auto& item = file.items[idx];
+					if (!needed[idx] || item.kind == ItemKind::Function || !emitted.try_emplace(item.key, true).second) continue;
+					emit(file, item, item.end, false, false, header);
+					header += '\n';
+				}
+			}
+			for (auto i = begin; i < set_end; ++i) {
+				auto [file_idx, item_idx] = _groups[shared[i]].instances[0];
+				emit_prototype(*_files[file_idx], _files[file_idx]->items[item_idx], header);
+			}
+			for (; begin < set_end; ++common_idx) {
+				auto chunk_end = std::min(set_end, begin + functions_per_common_file);
+				luisa::string out = header;
+				for (; begin < chunk_end; ++begin) {
+					auto [file_idx, item_idx] = _groups[shared[begin]].instances[0];
+					auto& file = *_files[file_idx];
+					auto& item = file.items[item_idx];
+					if (item.line_directive != ~0ull) {
+						emit(file, file.items[item.line_directive], file.items[item.line_directive].end, false, false, out);
+						out += '\n';
+					}
+					if (!clones.empty()) {
+						out += "LUISA_TARGET_CLONES ";
+					}
+					out += "LUISA_SHARED ";
+					emit(file, item, item.end, true, true, out);
+					out += '\n';
+				}
+				auto out_path = common_dir / luisa::format("common_{}.c", common_idx);
+				outputs.emplace_back(Output{out_path, write_if_changed(out_path, out)});
+			}
+		}
+		remove_common(common_dir, common_idx);
+		return outputs;
+	}
+	// Deletes common_<n>.c and its object and command files for n >= count, left by earlier runs with more shared functions.
+	static void remove_common(std::filesystem::path const& common_dir, size_t count) {
+		std::error_code ec;
+		luisa::vector<std::filesystem::path> stale;
+		for (auto& entry : std::filesystem::directory_iterator{common_dir, ec}) {
+			auto name = entry.path().filename().string();
+			if (!name.starts_with("common_")) continue;
+			size_t i = 7;
+			size_t idx = 0;
+			while (i < name.size() && name[i] >= '0' && name[i] <= '9') {
+				idx = idx * 10 + (name[i++] - '0');
+			}
+			auto ext = luisa::string_view{name}.substr(i);
+			if (i == 7 || idx < count || !(ext == ".c" || ext == ".o" || ext == ".obj" || ext == ".o.cmd" || ext == ".obj.cmd")) continue;
+			stale.emplace_back(entry.path());
+		}
+		for (auto& i : stale) {
+			std::filesystem::remove(i, ec);
+		}
+	}
+};
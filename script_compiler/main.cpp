@@ -28,6 +28,9 @@ string to_lower(string_view value) {
 }
 
 #include "preprocessor.h"
+#include "function_dedup.h"
+#include "size_report.h"
+#include "c_compiler.h"
 
 int main(int argc, char* argv[]) {
 	log_level_error();
@@ -44,9 +47,24 @@ int main(int argc, char* argv[]) {
 	luisa::vector<std::pair<luisa::vector<char>, bool>> target_files;
 	std::mutex code_mtx;
 	bool use_optimize = true;
+	// O0, O1, O2, O3 or Os, empty keeps the C compiler's default
+	luisa::string opt_level;
+	luisa::string march;
 	bool enable_help = false;
 	bool enable_lsp = false;
 	bool rebuild = false;
+	bool dedup = false;
+	bool strip_dead = false;
+	// keep line info and frame pointers in optimized code for sampling profilers
+	bool profile = false;
+	bool size_report = false;
+	// target_clones list of --isa
+	luisa::string target_clones;
+	luisa::string cc;
+	luisa::vector<luisa::string> cflags;
+	// extra define sets of a source, relative to --in, each builds one more specialized file
+	luisa::unordered_map<luisa::string, luisa::vector<luisa::vector<luisa::string>>> variants;
+	FingerprintKind fingerprint_kind = FingerprintKind::XXH3;
 	vstd::HashMap<vstd::string, vstd::function<void(vstd::string_view)>> cmds(16);
 	auto invalid_arg = []() {
 		LUISA_ERROR("Invalid argument, use --help please.");
@@ -58,12 +76,25 @@ int main(int argc, char* argv[]) {
 		auto lower_name = to_lower(name);
 		if (lower_name == "on"sv) {
 			use_optimize = true;
+			opt_level.clear();
 		} else if (lower_name == "off"sv) {
 			use_optimize = false;
+			opt_level.clear();
+		} else if (lower_name == "o0"sv || lower_name == "o1"sv || lower_name == "o2"sv || lower_name == "o3"sv || lower_name == "os"sv) {
+			use_optimize = lower_name != "o0"sv;
+			opt_level = luisa::format("O{}", lower_name[1]);
 		} else {
 			invalid_arg();
 		}
 	});
+	cmds.emplace(
+		"march"sv,
+		[&](string_view name) {
+		if (name.empty()) {
+			invalid_arg();
+		}
+		march = to_lower(name);
+	});
 	cmds.emplace(
 		"help"sv,
 		[&](string_view name) {
@@ -133,6 +164,104 @@ int main(int argc, char* argv[]) {
 		[&](string_view name) {
 		rebuild = true;
 	});
+	cmds.emplace(
+		"fingerprint"sv,
+		[&](string_view name) {
+		auto lower_name = to_lower(name);
+		if (lower_name == "xxh3"sv) {
+			fingerprint_kind = FingerprintKind::XXH3;
+		} else if (lower_name == "md5"sv) {
+			fingerprint_kind = FingerprintKind::MD5;
+		} else {
+			invalid_arg();
+		}
+	});
+	cmds.emplace(
+		"dedup"sv,
+		[&](string_view name) {
+		dedup = true;
+	});
+	cmds.emplace(
+		"gc"sv,
+		[&](string_view name) {
+		strip_dead = true;
+	});
+	cmds.emplace(
+		"profile"sv,
+		[&](string_view name) {
+		profile = true;
+	});
+	cmds.emplace(
+		"report"sv,
+		[&](string_view name) {
+		if (to_lower(name) != "size"sv) {
+			invalid_arg();
+		}
+		size_report = true;
+	});
+	cmds.emplace(
+		"isa"sv,
+		[&](string_view name) {
+		if (name.empty()) {
+			invalid_arg();
+		}
+		target_clones.clear();
+		while (!name.empty()) {
+			auto comma = std::min(name.find(','), name.size());
+			auto lower_isa = to_lower(name.substr(0, comma));
+			name.remove_prefix(std::min(comma + 1, name.size()));
+			string_view clone;
+			if (lower_isa == "sse4.2"sv) {
+				clone = "sse4.2"sv;
+			} else if (lower_isa == "avx"sv) {
+				clone = "avx"sv;
+			} else if (lower_isa == "avx2"sv) {
+				clone = "avx2"sv;
+			} else if (lower_isa == "avx512"sv || lower_isa == "avx512f"sv) {
+				clone = "avx512f"sv;
+			} else if (lower_isa == "x86-64-v2"sv || lower_isa == "x86-64-v3"sv || lower_isa == "x86-64-v4"sv) {
+				target_clones += luisa::format("\"arch={}\", ", lower_isa);
+				continue;
+			} else {
+				invalid_arg();
+			}
+			target_clones += luisa::format("\"{}\", ", clone);
+		}
+		target_clones += "\"default\""sv;
+	});
+	cmds.emplace(
+		"cc"sv,
+		[&](string_view name) {
+		if (name.empty()) {
+			invalid_arg();
+		}
+		cc = name;
+	});
+	cmds.emplace(
+		"variant"sv,
+		[&](string_view name) {
+		auto colon = name.find(':');
+		if (colon == string_view::npos || colon == 0 || colon + 1 == name.size()) {
+			invalid_arg();
+		}
+		auto& variant_defines = variants[luisa::string{name.substr(0, colon)}].emplace_back();
+		name.remove_prefix(colon + 1);
+		while (!name.empty()) {
+			auto comma = std::min(name.find(','), name.size());
+			if (comma > 0) {
+				variant_defines.emplace_back(name.substr(0, comma));
+			}
+			name.remove_prefix(std::min(comma + 1, name.size()));
+		}
+	});
+	cmds.emplace(
+		"cflag"sv,
+		[&](string_view name) {
+		if (name.empty()) {
+			invalid_arg();
+		}
+		cflags.emplace_back(name);
+	});
 	// TODO: define
 	for (auto i : vstd::ptr_range(argv + 1, argc - 1)) {
 		string arg = i;
@@ -173,13 +302,23 @@ Argument format:
     argument should be -ARG=VALUE or --ARG=VALUE, invalid argument will cause fatal error and never been ignored.
 
 Argument list:
-    --opt: enable or disable optimize, E.g --opt=on, --opt=off, case ignored.
+    --opt: enable or disable optimize, or pick the C optimization level O0, O1, O2, O3 or Os, E.g --opt=on, --opt=off, --opt=O3, case ignored.
+    --march: target ISA of the generated C, E.g --march=native, --march=x86-64-v3
     --backend: backend name, currently support "dx", "cuda", "metal", case ignored.
     --in: input file or dir, E.g --in=./my_dir/my_shader.cpp
-    --out: output file or dir, E.g --out=./my_dir/my_shader.c
+    --out: output file or dir, E.g --out=./my_dir/my_shader.c, a dir output also gets compile_c.lua and the dependency manifest deps.json
     --include: include file directory, E.g --include=./shader_dir/
     --D: shader predefines, this can be set multiple times, E.g --D=MY_MACRO
     --lsp: enable compile_commands.json generation, E.g --lsp
+    --fingerprint: hash of preprocessed sources used to skip unchanged files, "xxh3"(default) or "md5", E.g --fingerprint=md5
+    --dedup: move static functions that several generated files define identically into shared common_*.c files, the files are compiled after all scripts are generated. trades speed for size: shared functions are called across object files and can not be inlined without LTO, E.g --dedup
+    --gc: drop static functions of the generated C that no kernel, export, variable or constructor, destructor or used function reaches, before the C compiler parses them, E.g --gc
+    --profile: keep #line info pointing at the script sources and frame pointers in optimized code, so perf and other sampling profilers report script lines, E.g --profile
+    --report: write size_report.json into the out dir, listing every function of the generated C with its token, source and machine code bytes (ELF objects of --cc only) and the line it was generated from (--profile only), per file and summed over all files, largest first, E.g --report=size
+    --isa: build exported functions of the generated C once per ISA and pick the best clone for the CPU at load time, needs GCC or Clang on ELF. static functions are not cloned, they only run the ISA code where the C compiler inlines them into an exported function or a --dedup shared one, E.g --isa=sse4.2,avx2,avx512
+    --cc: compile every generated .c file with this C compiler right after it is generated, compile_c.lua then lists object files, E.g --cc=clang
+    --variant: also build a source with these extra defines, the output gets the defines appended to its name, this can be set multiple times, E.g --variant=test_fib.cpp:FIB_LAYER=9 builds test_fib_FIB_LAYER_9.c
+    --cflag: extra flag passed to the --cc compiler, this can be set multiple times, E.g --cflag=-O2
 )"sv;
 		std::cout << helplist << '\n';
 		return 0;
@@ -351,14 +490,187 @@ Argument list:
 				}
 			}
 		}
+		// generated code depends on these too, changing them regenerates every script
+		auto option_key = luisa::format(
+			"backend={};opt={};profile={}",
+			backend,
+			use_optimize ? "on"sv : "off"sv,
+			profile);
 		Preprocessor processor{
 			lmdb_cache_path,
 			cache_path / ".obj",
+			cache_path / ".tokens",
 			iter,
-			inc_iter};
+			inc_iter,
+			fingerprint_kind,
+			option_key};
 
-		void* main_fn{};
+		auto push_target_file = [&](std::filesystem::path const& path, bool compile) {
+			auto out_name = luisa::to_string(path);
+			luisa::vector<char> name;
+			name.reserve(out_name.size());
+			for (auto& i : out_name) {
+				switch (i) {
+					case '"':
+						vstd::push_back_all(name, "\\\"", 2);
+						break;
+					case '\\':
+						name.push_back('/');
+						break;
+					default:
+						name.push_back(i);
+						break;
+				}
+			}
+			std::lock_guard lck{code_mtx};
+			target_files.emplace_back(std::move(name), compile);
+		};
+		auto object_path = [](std::filesystem::path const& c_path) {
+			auto obj_path = c_path;
+#ifdef _WIN32
+			obj_path.replace_extension(".obj");
+#else
+			obj_path.replace_extension(".o");
+#endif
+			return obj_path;
+		};
+		// with --cc every generated file is handed to the C compiler threads right away, the rule then only links the objects
+		luisa::unique_ptr<CCompiler> c_compiler;
+		bool msvc_style = false;
+		luisa::string_view march_flag;
+		if (!cc.empty()) {
+			c_compiler = luisa::make_unique<CCompiler>();
+			auto cc_name = to_lower(luisa::to_string(std::filesystem::path{cc}.stem()));
+			msvc_style = cc_name == "cl"sv || cc_name == "clang-cl"sv;
+			if (!msvc_style) {
+				march_flag = march;
+			} else if (march == "x86-64-v3"sv || march == "haswell"sv) {
+				march_flag = "/arch:AVX2"sv;
+			} else if (march == "x86-64-v4"sv || march == "skylake-avx512"sv) {
+				march_flag = "/arch:AVX512"sv;
+			} else if (!march.empty()) {
+				LUISA_WARNING("--march={} has no /arch option of {}, the generated C is built for its default ISA.", march, cc);
+			}
+		}
+		// objects depend on the C compiler options, which do not change the generated code.
+		// --cc keys every object by its command line, without it the C files are all compiled again when these change
+		bool c_options_changed = false;
+		auto c_options_path = cache_path / "c_options";
+		auto c_options = luisa::format("opt={};march={};cc={}", opt_level, march, cc);
+		for (auto& i : cflags) {
+			c_options += ";cflag=";
+			c_options += i;
+		}
+		{
+			luisa::string old_c_options;
+			read_file(c_options_path, old_c_options);
+			c_options_changed = old_c_options != c_options;
+		}
+		auto compile_args = [&](std::filesystem::path const& c_path, std::filesystem::path const& obj_path) {
+			luisa::vector<luisa::string> args;
+			args.emplace_back(cc);
+			for (auto& i : cflags) {
+				args.emplace_back(i);
+			}
+			// after the extra flags, so the selected level and ISA win
+			if (!opt_level.empty()) {
+				if (msvc_style) {
+					args.emplace_back(opt_level == "O0"sv ? "/Od"sv : (opt_level == "O1"sv || opt_level == "Os"sv) ? "/O1"sv : "/O2"sv);
+				} else {
+					args.emplace_back(luisa::format("-{}", opt_level));
+				}
+			}
+			if (profile) {
+				if (msvc_style) {
+					args.emplace_back("/Z7");
+					args.emplace_back("/Oy-");
+				} else {
+					args.emplace_back("-g");
+					args.emplace_back("-fno-omit-frame-pointer");
+				}
+			}
+			if (!march_flag.empty()) {
+				args.emplace_back(msvc_style ? luisa::string{march_flag} : luisa::format("-march={}", march_flag));
+			}
+			if (msvc_style) {
+				args.emplace_back("/nologo");
+				args.emplace_back("/c");
+				args.emplace_back(luisa::to_string(c_path));
+				args.emplace_back(luisa::format("/Fo{}", luisa::to_string(obj_path)));
+			} else {
+				args.emplace_back("-c");
+				args.emplace_back(luisa::to_string(c_path));
+				args.emplace_back("-o");
+				args.emplace_back(luisa::to_string(obj_path));
+			}
+			return args;
+		};
+		SizeReport report;
 		std::atomic_bool failed = false;
+		auto add_report = [&](std::filesystem::path const& c_path) {
+			if (size_report) {
+				auto file = std::filesystem::relative(c_path, dst_path).generic_string();
+				report.add(luisa::string{file.data(), file.size()}, c_path, object_path(c_path));
+			}
+		};
+		// the C files that are finally compiled, with their objects if --cc builds them
+		// a failed compile drops source_key from the fingerprint cache, so the next run generates it again
+		auto add_final = [&](std::filesystem::path const& c_path, bool compile, luisa::string source_key) {
+			if (!c_compiler) {
+				push_target_file(c_path, compile || c_options_changed);
+				add_report(c_path);
+				return;
+			}
+			auto obj_path = object_path(c_path);
+			auto args = compile_args(c_path, obj_path);
+			c_compiler->submit(c_path, obj_path, std::move(args), [&, c_path, obj_path, source_key = std::move(source_key)](bool success) {
+				if (!success) {
+					if (!source_key.empty()) {
+						processor.remove_file(source_key);
+					}
+					failed = true;
+					return;
+				}
+				push_target_file(obj_path, false);
+				add_report(c_path);
+			});
+		};
+		// --gc and --isa rewrite every generated file on its own, so it is compiled right away.
+		// --dedup needs all of them, the files are scanned as they come and written and compiled after generation
+		bool post_process = dedup || strip_dead || !target_clones.empty();
+		FunctionDedup function_dedup;
+		FunctionDedup::Settings dedup_settings{
+			.share = dedup,
+			.option_key = option_key,
+			.target_clones = target_clones,
+			.strip_dead = strip_dead};
+		auto add_generated = [&](std::filesystem::path const& c_path, bool compile, luisa::string const& source_key) {
+			if (dedup) {
+				function_dedup.add(c_path);
+			} else if (post_process) {
+				auto output = function_dedup.run_single(c_path, dedup_settings);
+				add_final(output.path, output.changed, source_key);
+			} else {
+				add_final(c_path, compile, source_key);
+			}
+		};
+
+		auto variant_path = [](std::filesystem::path out_path, luisa::span<luisa::string_view const> extra_defines) {
+			auto out_filename = luisa::to_string(out_path.replace_extension("").filename());
+			for (auto& i : extra_defines) {
+				if (i.empty()) continue;
+				out_filename += "_";
+				// the file name ends up in the exported kernel names, E.g FIB_LAYER=9 becomes _FIB_LAYER_9
+				for (auto c : i) {
+					bool ident = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+					out_filename += ident ? c : '_';
+				}
+			}
+			out_path.replace_filename(out_filename).replace_extension(".c");
+			return out_path;
+		};
+
+		void* main_fn{};
 		luisa::fiber::parallel(
 			paths.size(),
 			[&](size_t idx) {
@@ -368,69 +680,36 @@ Argument list:
 				file_path = std::filesystem::relative(file_path, src_path);
 			}
 			auto out_path = dst_path / file_path;
-			if (!processor.require_recompile(src_path, file_path)) {
-				auto local_out_path = out_path;
-				auto out_filename = luisa::to_string(local_out_path.replace_extension("").filename());
-				local_out_path.replace_filename(out_filename).replace_extension(".c");
-				{
-					auto out_name = luisa::to_string(local_out_path);
-					luisa::vector<char> cc;
-					cc.reserve(out_name.size());
-					for (auto& i : out_name) {
-						switch (i) {
-							case '"':
-								vstd::push_back_all(cc, "\\\"", 2);
-								break;
-							case '\\':
-								cc.push_back('/');
-								break;
-							default:
-								cc.push_back(i);
-								break;
-						}
-					}
-					std::lock_guard lck{code_mtx};
-					target_files.emplace_back(std::move(cc), false);
+			// the plain file first, then one file per --variant of it
+			luisa::vector<luisa::vector<luisa::string_view>> define_sets(1);
+			auto variant_name = file_path.generic_string();
+			if (auto iter = variants.find(luisa::string{variant_name.data(), variant_name.size()}); iter != variants.end()) {
+				for (auto& i : iter->second) {
+					define_sets.emplace_back(i.begin(), i.end());
 				}
-				return;
 			}
-			create_dir(out_path);
+			auto source_path = luisa::to_string(std::filesystem::weakly_canonical(src_path / file_path));
 			// out_path.replace_extension("bin");
 			int result = 0;
-			auto exec_func = [&](luisa::span<luisa::string_view> extra_defines) {
+			auto exec_func = [&](luisa::span<luisa::string_view> extra_defines, luisa::string const& source_key) {
 				luisa::vector<char> vec;
-				auto local_out_path = out_path;
-				auto out_filename = luisa::to_string(local_out_path.replace_extension("").filename());
-				for (auto& i : extra_defines) {
-					if (i.empty()) continue;
-					out_filename += "_";
-					out_filename += i;
-				}
-				local_out_path.replace_filename(out_filename).replace_extension(".c");
-				{
-					auto out_name = luisa::to_string(local_out_path);
-					luisa::vector<char> cc;
-					cc.reserve(out_name.size());
-					for (auto& i : out_name) {
-						switch (i) {
-							case '"':
-								vstd::push_back_all(cc, "\\\"", 2);
-								break;
-							case '\\':
-								cc.push_back('/');
-								break;
-							default:
-								cc.push_back(i);
-								break;
-						}
-					}
-					std::lock_guard lck{code_mtx};
-					target_files.emplace_back(std::move(cc), true);
-				}
+				auto local_out_path = variant_path(out_path, extra_defines);
 				add(vec, argv[0]);
 				add(vec, ' ');
 				add(vec, "-opt="sv);
-				add(vec, use_optimize ? "on"sv : "off"sv);
+				if (opt_level.empty()) {
+					add(vec, use_optimize ? "on"sv : "off"sv);
+				} else {
+					add(vec, opt_level);
+				}
+				if (!march.empty()) {
+					add(vec, ' ');
+					add(vec, "-march="sv);
+					add(vec, march);
+				}
+				if (profile) {
+					add(vec, " -profile"sv);
+				}
 				add(vec, ' ');
 				add(vec, "-backend="sv);
 				add(vec, backend);
@@ -462,15 +741,43 @@ Argument list:
 				vec.emplace_back(0);
 				LUISA_INFO("compiling {}{}", luisa::to_string(file_path.filename()), macro);
 				result = system(vec.data());
+				if (result != 0) {
+					return;
+				}
+				add_generated(local_out_path, true, source_key);
 			};
-			exec_func({});
-			// TODO: variant
-			if (result != 0) {
-				processor.remove_file(luisa::to_string(std::filesystem::weakly_canonical(src_path / file_path)));
-				failed = true;
+			// every variant is preprocessed with its defines and has a fingerprint of its own
+			for (auto& i : define_sets) {
+				auto source_key = Preprocessor::entry_key(source_path, i);
+				if (!processor.require_recompile(src_path, file_path, i)) {
+					add_generated(variant_path(out_path, i), false, source_key);
+					continue;
+				}
+				create_dir(out_path);
+				exec_func(i, source_key);
+				if (result != 0) {
+					processor.remove_file(source_key);
+					failed = true;
+					break;
+				}
 			}
 		});
+		if (dedup && !failed) {
+			auto outputs = function_dedup.run(dst_path, dedup_settings);
+			for (auto& output : outputs) {
+				add_final(output.path, output.changed, {});
+			}
+		} else if (!dedup) {
+			// nothing is shared now, the common files of an earlier --dedup build must not be linked again
+			FunctionDedup::remove_common(dst_path, 0);
+		}
+		if (c_compiler) {
+			c_compiler->wait();
+		}
 		processor.post_process();
+		if (size_report && !failed) {
+			report.write(dst_path / "size_report.json");
+		}
 		pdqsort(target_files.begin(), target_files.end(), [](auto&& a, auto&& b) {
 			auto&& astr = a.first;
 			auto&& bstr = b.first;
@@ -518,9 +825,66 @@ Argument list:
 			fwrite(lua_code.data(), lua_code.size(), 1, f);
 			fclose(f);
 		}
+		// dependency manifest for the build rule, which skips running the compiler while no listed file is newer
+		auto deps_path = dst_path / "deps.json";
 		if (failed) {
+			std::error_code ec;
+			std::filesystem::remove(deps_path, ec);
 			return 1;
 		}
+		if (c_options_changed) {
+			if (auto f = fopen(luisa::to_string(c_options_path).c_str(), "wb")) {
+				fwrite(c_options.data(), c_options.size(), 1, f);
+				fclose(f);
+			}
+		}
+		auto json_array = [&](auto const& range) {
+			luisa::string r = "[";
+			bool comma = false;
+			for (auto& i : range) {
+				if (comma) {
+					r += ",";
+				}
+				comma = true;
+				r += "\n    ";
+				r += json_string(i);
+			}
+			r += "\n  ]";
+			return r;
+		};
+		luisa::vector<luisa::string> args;
+		for (auto i : vstd::ptr_range(argv + 1, argc - 1)) {
+			args.emplace_back(i);
+		}
+		luisa::vector<luisa::string> sources;
+		sources.reserve(paths.size());
+		for (auto& i : paths) {
+			auto source = std::filesystem::relative(i, src_path).generic_string();
+			sources.emplace_back(source.data(), source.size());
+		}
+		pdqsort(sources.begin(), sources.end());
+		auto deps = luisa::format(
+			"{{\n  \"version\": 1,\n  \"args\": {},\n  \"sources\": {},\n  \"files\": {}\n}}\n",
+			json_array(args),
+			json_array(sources),
+			json_array(processor.dependencies()));
+		auto deps_tmp_path = deps_path;
+		deps_tmp_path += ".tmp";
+		auto deps_tmp_path_str = luisa::to_string(deps_tmp_path);
+		f = fopen(deps_tmp_path_str.c_str(), "wb");
+		if (f) {
+			bool success = fwrite(deps.data(), deps.size(), 1, f) == 1;
+			success &= fclose(f) == 0;
+			std::error_code ec;
+			if (success) {
+				std::filesystem::rename(deps_tmp_path, deps_path, ec);
+			}
+			if (!success || ec) [[unlikely]] {
+				LUISA_WARNING("Write dependency manifest '{}' failed.", luisa::to_string(deps_path));
+				std::filesystem::remove(deps_tmp_path, ec);
+				std::filesystem::remove(deps_path, ec);
+			}
+		}
 		return 0;
 	}
 	//////// Compile
@@ -544,7 +908,7 @@ Argument list:
 	if (!luisa::clangcxx::Compiler::create_shader(
 			ShaderOption{
 				.enable_fast_math = use_optimize,
-				.enable_debug_info = !use_optimize,
+				.enable_debug_info = !use_optimize || profile,
 				.compile_only = true,
 				.name = luisa::to_string(dst_path)},
 			device, iter, src_path, inc_iter)) {
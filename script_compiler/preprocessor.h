@@ -6,6 +6,7 @@
 #include <luisa/vstl/functional.h>
 #include <luisa/vstl/lmdb.hpp>
 #include <luisa/vstl/md5.h>
+#include <luisa/core/stl/hash.h>
 #include <luisa/clangcxx/compiler.h>
 #include <luisa/core/fiber.h>
 #include <luisa/runtime/context.h>
@@ -14,6 +15,7 @@
 #include <luisa/core/stl/pdqsort.h>
 #include <luisa/vstl/spin_mutex.h>
 #include "simplecpp.h"
+#include "token_cache.h"
 #include <mimalloc.h>
 using namespace luisa;
 template<typename Vec, typename T>
@@ -27,9 +29,82 @@ void add(Vec&& result, T c) {
 	}
 };
 
+enum class FingerprintKind : uint8_t {
+	XXH3,
+	MD5
+};
+using Fingerprint = std::array<std::byte, 16>;
+
+// Fingerprints preprocessed text in fixed size chunks, so a translation unit never has to be held in memory as a whole.
+// XXH3 runs two differently seeded 64-bit chains, MD5 chains each chunk with the digest of the previous one.
+class FingerprintSink final : public simplecpp::OutputSink {
+	static constexpr size_t chunk_size = 64 * 1024;
+	static constexpr size_t digest_size = sizeof(Fingerprint);
+	FingerprintKind _kind;
+	// MD5: [previous digest][chunk], XXH3: [chunk]
+	luisa::vector<char> _buffer;
+	size_t _size{};
+	size_t _total_size{};
+	uint64_t _hash0{0x9e3779b97f4a7c15ull};
+	uint64_t _hash1{0xc2b2ae3d27d4eb4full};
+	char* chunk() {
+		return _buffer.data() + (_kind == FingerprintKind::MD5 ? digest_size : 0);
+	}
+	void flush() {
+		if (_kind == FingerprintKind::MD5) {
+			vstd::MD5 md5{{reinterpret_cast<uint8_t const*>(_buffer.data()), digest_size + _size}};
+			static_assert(sizeof(md5) == digest_size);
+			memcpy(_buffer.data(), &md5, digest_size);
+		} else {
+			_hash0 = luisa::hash64(chunk(), _size, _hash0);
+			_hash1 = luisa::hash64(chunk(), _size, _hash1);
+		}
+		_size = 0;
+	}
+
+public:
+	explicit FingerprintSink(FingerprintKind kind) : _kind(kind) {
+		_buffer.push_back_uninitialized(chunk_size + (kind == FingerprintKind::MD5 ? digest_size : 0));
+		if (kind == FingerprintKind::MD5) {
+			memset(_buffer.data(), 0, digest_size);
+		}
+	}
+	void write(const char* data, size_t size) override {
+		_total_size += size;
+		while (size > 0) {
+			auto copy_size = std::min(size, chunk_size - _size);
+			memcpy(chunk() + _size, data, copy_size);
+			_size += copy_size;
+			data += copy_size;
+			size -= copy_size;
+			if (_size == chunk_size) {
+				flush();
+			}
+		}
+	}
+	Fingerprint finish() {
+		if (_size > 0 || _total_size == 0) {
+			flush();
+		}
+		Fingerprint r;
+		if (_kind == FingerprintKind::MD5) {
+			memcpy(r.data(), _buffer.data(), digest_size);
+		} else {
+			_hash0 = luisa::hash64(&_total_size, sizeof(_total_size), _hash0);
+			memcpy(r.data(), &_hash0, sizeof(uint64_t));
+			memcpy(r.data() + sizeof(uint64_t), &_hash1, sizeof(uint64_t));
+		}
+		return r;
+	}
+};
+
 class Preprocessor {
 	vstd::LMDB db;
+	FingerprintKind _fingerprint_kind;
+	// compiler options that change the generated code, mixed into every fingerprint
+	luisa::string _option_key;
 	std::filesystem::path _cache_path;
+	TokenCache _token_cache;
 	luisa::vector<luisa::string_view> _defines;
 	luisa::vector<luisa::string> _inc_paths;
 	vstd::spin_mutex _time_mtx;
@@ -37,6 +112,13 @@ class Preprocessor {
 	vstd::HashMap<luisa::string, DBValue> _last_write_times;
 	vstd::spin_mutex _remove_mtx;
 	luisa::vector<luisa::vector<std::byte>> _remove_list;
+	// every source and header read by this run, written to the dependency manifest
+	vstd::spin_mutex _dependency_mtx;
+	luisa::unordered_set<luisa::string> _dependencies;
+	void add_dependency(luisa::string_view name) {
+		std::lock_guard lck{_dependency_mtx};
+		_dependencies.emplace(name);
+	}
 	void update_file(luisa::string_view name, std::filesystem::file_time_type time, luisa::span<const std::byte> data) {
 		DBValue vec;
 		vec.reserve(data.size() + sizeof(time));
@@ -55,8 +137,12 @@ class Preprocessor {
 		return file_is_new(name, db_value);
 	}
 	bool file_is_new(luisa::string_view name, luisa::span<const std::byte>& db_value) {
-		db_value = db.read(name);
-		auto cur_time = std::filesystem::last_write_time(std::filesystem::path{name});
+		return file_is_new(name, std::filesystem::path{name}, db_value);
+	}
+	// key is the path of the file, or an entry_key of it
+	bool file_is_new(luisa::string_view key, std::filesystem::path const& path, luisa::span<const std::byte>& db_value) {
+		db_value = db.read(key);
+		auto cur_time = std::filesystem::last_write_time(path);
 		if (db_value.size_bytes() >= sizeof(std::filesystem::file_time_type)) {
 			std::filesystem::file_time_type old_time;
 			memcpy(&old_time, db_value.data(), sizeof(old_time));
@@ -64,7 +150,7 @@ class Preprocessor {
 				return false;
 			}
 		}
-		update_file(name, cur_time, {});
+		update_file(key, cur_time, {});
 		return true;
 	}
 
@@ -72,9 +158,12 @@ public:
 	Preprocessor(
 		std::filesystem::path const& db_path,
 		std::filesystem::path&& cache_path,
+		std::filesystem::path&& token_cache_path,
 		vstd::IRange<luisa::string_view>& defines,
-		vstd::IRange<luisa::string>& inc_paths)
-		: db(db_path, std::max<size_t>(126ull, std::thread::hardware_concurrency() * 2)), _cache_path(std::move(cache_path)) {
+		vstd::IRange<luisa::string>& inc_paths,
+		FingerprintKind fingerprint_kind = FingerprintKind::XXH3,
+		luisa::string_view option_key = {})
+		: db(db_path, std::max<size_t>(126ull, std::thread::hardware_concurrency() * 2)), _fingerprint_kind(fingerprint_kind), _option_key(option_key), _cache_path(std::move(cache_path)), _token_cache(std::move(token_cache_path)) {
 		if (!std::filesystem::exists(_cache_path)) {
 			std::error_code ec;
 			std::filesystem::create_directories(_cache_path, ec);
@@ -89,12 +178,34 @@ public:
 			_inc_paths.emplace_back(std::move(i));
 		}
 	}
+	// cache entry of a source built with extra defines, a --variant gets its own fingerprint and include list
+	static luisa::string entry_key(luisa::string_view path, luisa::span<luisa::string_view const> extra_defines) {
+		luisa::string key{path};
+		for (auto&& i : extra_defines) {
+			if (i.empty()) continue;
+			key += '\n';
+			key += i;
+		}
+		return key;
+	}
 	void remove_file(luisa::string_view name) {
 		std::lock_guard lck{_remove_mtx};
 		auto& v = _remove_list.emplace_back();
 		v.push_back_uninitialized(name.size());
 		memcpy(v.data(), name.data(), name.size());
 	}
+	luisa::vector<luisa::string> dependencies() {
+		luisa::vector<luisa::string> r;
+		{
+			std::lock_guard lck{_dependency_mtx};
+			r.reserve(_dependencies.size());
+			for (auto&& i : _dependencies) {
+				r.emplace_back(i);
+			}
+		}
+		pdqsort(r.begin(), r.end());
+		return r;
+	}
 	void post_process() {
 		luisa::vector<vstd::LMDBWriteCommand> write_cmds;
 		write_cmds.reserve(_last_write_times.size());
@@ -151,7 +262,8 @@ public:
 	}
 	bool require_recompile(
 		std::filesystem::path const& src_dir,
-		std::filesystem::path const& file_dir) {
+		std::filesystem::path const& file_dir,
+		luisa::span<luisa::string_view const> extra_defines = {}) {
 		std::error_code ec;
 		auto file_abs_dir = std::filesystem::canonical(src_dir / file_dir, ec);
 		if (ec) [[unlikely]] {
@@ -161,6 +273,7 @@ public:
 			LUISA_ERROR("Get file last write time '{}' failed, message: {}", luisa::to_string(_cache_path), ec.message());
 		}
 		auto file_abs_dir_str = luisa::to_string(file_abs_dir);
+		auto key = entry_key(file_abs_dir_str, extra_defines);
 		if (ec) [[unlikely]] {
 			LUISA_ERROR("Invalid canonical file path '{}' failed, message: {}", luisa::to_string(file_dir), ec.message());
 		}
@@ -171,38 +284,49 @@ public:
 		luisa::span<const std::byte> db_value;
 		auto preprocess = [&]<bool check_preprocess = true>() {
 			auto preprocess_path = std::filesystem::weakly_canonical(_cache_path / guid.to_string(false), ec);
-			vstd::MD5 old_md5;
+			Fingerprint old_fingerprint{};
 			if constexpr (check_preprocess) {
 				int64_t lefted_size = db_value.size_bytes() - sizeof(std::filesystem::file_time_type);
-				if (lefted_size >= int64_t(sizeof(vstd::MD5))) {
-					memcpy(&old_md5, db_value.data() + sizeof(std::filesystem::file_time_type), sizeof(vstd::MD5));
+				if (lefted_size >= int64_t(sizeof(Fingerprint))) {
+					memcpy(&old_fingerprint, db_value.data() + sizeof(std::filesystem::file_time_type), sizeof(Fingerprint));
 				}
 			}
 			std::vector<std::string> files;
-			std::string preprocessed_path;
+			Fingerprint fingerprint;
 			{
 				simplecpp::DUI dui;
 				dui.removeComments = true;
+				dui.lazyConditionals = true;
+				dui.headerLoader = &_token_cache;
 				for (auto&& i : _inc_paths) {
 					dui.includePaths.emplace_back(i);
 				}
 				for (auto&& i : _defines) {
 					dui.defines.emplace_back(i);
 				}
+				for (auto&& i : extra_defines) {
+					if (!i.empty()) dui.defines.emplace_back(i);
+				}
 				std::map<std::string, simplecpp::TokenList*> filedata;
 				std::string filename{file_abs_dir_str};
 				simplecpp::OutputList outputList;
-				simplecpp::TokenList rawtokens(filename, files, &outputList);
+				simplecpp::TokenList rawtokens(filename, files, &outputList, dui.lazyConditionals);
 				rawtokens.removeComments();
+				filedata = simplecpp::load(rawtokens, files, dui, &outputList);
 				simplecpp::TokenList outputTokens(files);
 				simplecpp::preprocess(outputTokens, rawtokens, files, filedata, dui, &outputList);
-				preprocessed_path = outputTokens.stringify();
+				FingerprintSink sink{_fingerprint_kind};
+				sink.write(_option_key.data(), _option_key.size());
+				outputTokens.stringify(sink);
+				fingerprint = sink.finish();
 				simplecpp::cleanup(filedata);
 			}
+			for (auto&& i : files) {
+				add_dependency(luisa::to_string(std::filesystem::weakly_canonical(i, ec)));
+			}
 			{
-				vstd::MD5 md5{{reinterpret_cast<uint8_t const*>(preprocessed_path.data()), preprocessed_path.size()}};
 				if constexpr (check_preprocess) {
-					if (old_md5 == md5) {
+					if (old_fingerprint == fingerprint) {
 						return false;
 					}
 				}
@@ -220,7 +344,7 @@ public:
 						memcpy(vec.data() + last_size, a.data(), a.size_bytes());
 					}
 				};
-				push(md5.to_binary());
+				push(fingerprint);
 				// nlohmann::json js_arr;
 				for (auto&& i : files) {
 					auto inc_path = std::filesystem::weakly_canonical(i, ec);
@@ -230,15 +354,16 @@ public:
 					push(path);
 				}
 				// auto js_str = js_arr.dump();
-				update_file(file_abs_dir_str, std::filesystem::last_write_time(file_abs_dir), vec);
+				update_file(key, std::filesystem::last_write_time(file_abs_dir), vec);
 			}
 			return true;
 		};
-		if (file_is_new(file_abs_dir_str, db_value)) {
+		add_dependency(file_abs_dir_str);
+		if (file_is_new(key, file_abs_dir, db_value)) {
 			return preprocess();
 		}
 		// check include files
-		auto header_size = sizeof(std::filesystem::file_time_type) + sizeof(vstd::MD5);
+		auto header_size = sizeof(std::filesystem::file_time_type) + sizeof(Fingerprint);
 		int64_t data_size = db_value.size() - header_size;
 		if (data_size > 0) {
 			auto ptr = db_value.data() + header_size;
@@ -259,6 +384,7 @@ public:
 					force_check = true;
 					break;
 				}
+				add_dependency(name);
 				if (file_is_new(name)) {
 					force_check = true;
 					break;
@@ -36,6 +36,7 @@
 #include <mutex>
 #endif
 #include <unordered_map>
+#include <unordered_set>
 #endif
 #include <utility>
 #include <vector>
@@ -251,6 +252,19 @@ public:
     virtual void unget() = 0;
     virtual bool good() = 0;
 
+    /**
+     * Reads the raw text of a conditional block, up to the line holding the matching
+     * #elif/#else/#endif. Streams that can't do this, or blocks that can't be skipped
+     * at byte level, return false without consuming anything.
+     * @param text output: source text of the block
+     * @param newlines output: number of lines in the block
+     */
+    virtual bool skipConditionalBlock(std::string &text, unsigned int &newlines) {
+        (void)text;
+        (void)newlines;
+        return false;
+    }
+
     unsigned char readChar() {
         unsigned char ch = static_cast<unsigned char>(get());
 
@@ -379,6 +393,180 @@ private:
     std::istream &istr;
 };
 
+static bool isNameChar(unsigned char ch)
+{
+    return std::isalnum(ch) || ch == '_' || ch == '$';
+}
+
+/**
+ * Finds the end of the conditional block that starts at pos: the start of the line
+ * holding the matching #elif/#else/#endif. Only what can hide or split a directive is
+ * recognized: comments, string and character literals and line splices.
+ * @return end of the block, or std::string::npos if the block must be tokenized
+ * (unterminated block or literal, raw strings, #line directives, unhandled characters)
+ */
+static std::size_t findConditionalBlockEnd(const unsigned char *str, std::size_t size, std::size_t pos, unsigned int *newlines)
+{
+    unsigned int depth = 0;
+    unsigned int lines = 0;
+    std::size_t lineStart = pos;
+    bool lineStartInComment = false;
+    bool inComment = false;
+    bool inDirective = false;
+    bool sawToken = false;          // a non-comment token precedes pos on this line
+    bool inName = false;            // pos directly follows a name or number character
+    bool numberRun = false;         // inside a number (digit separators)
+    unsigned char lastChar = '\0';  // last character outside comments and whitespace
+
+    while (pos < size) {
+        const unsigned char ch = str[pos];
+
+        if (ch == '\r' || ch == '\n') {
+            pos += (ch == '\r' && pos + 1U < size && str[pos + 1U] == '\n') ? 2U : 1U;
+            ++lines;
+            if (lastChar == '\\' && !inComment) {
+                // line splice
+                lastChar = ' ';
+                continue;
+            }
+            if (inComment && inDirective)
+                continue;
+            inDirective = false;
+            sawToken = false;
+            inName = false;
+            lastChar = '\0';
+            lineStart = pos;
+            lineStartInComment = inComment;
+            continue;
+        }
+
+        if (inComment) {
+            if (ch == '*' && pos + 1U < size && str[pos + 1U] == '/') {
+                inComment = false;
+                pos += 2U;
+                continue;
+            }
+            ++pos;
+            continue;
+        }
+
+        if (ch >= 0x80)
+            return std::string::npos;
+
+        if (ch == ' ' || ch == '\t' || ch == '\v' || ch == '\f') {
+            inName = false;
+            ++pos;
+            continue;
+        }
+
+        if (ch == '/' && pos + 1U < size && str[pos + 1U] == '/') {
+            // a '\' ending the line splices the next line into the comment, a directive there is commented out
+            while (pos < size) {
+                if (str[pos] == '\r' || str[pos] == '\n') {
+                    if (str[pos - 1U] != '\\')
+                        break;
+                    pos += (str[pos] == '\r' && pos + 1U < size && str[pos + 1U] == '\n') ? 2U : 1U;
+                    ++lines;
+                    continue;
+                }
+                ++pos;
+            }
+            lastChar = '/';
+            inName = false;
+            continue;
+        }
+
+        if (ch == '/' && pos + 1U < size && str[pos + 1U] == '*') {
+            inComment = true;
+            inName = false;
+            pos += 2U;
+            continue;
+        }
+
+        if (ch == '#' && !sawToken && !inDirective) {
+            std::size_t i = pos + 1U;
+            while (i < size && (str[i] == ' ' || str[i] == '\t'))
+                ++i;
+            if (i + 1U < size && str[i] == '/' && str[i + 1U] == '*')
+                return std::string::npos; // directive name depends on comment removal
+            std::size_t nameEnd = i;
+            while (nameEnd < size && isNameChar(str[nameEnd]))
+                ++nameEnd;
+            const std::string directive(reinterpret_cast<const char *>(str) + i, nameEnd - i);
+            if (!directive.empty() && std::isdigit(static_cast<unsigned char>(directive[0])))
+                return std::string::npos;
+            if (directive == "line" || directive == "file" || directive == "endfile")
+                return std::string::npos;
+            if (directive == "if" || directive == "ifdef" || directive == "ifndef")
+                ++depth;
+            else if (directive == "endif" || directive == "elif" || directive == "else") {
+                if (depth == 0) {
+                    if (lineStartInComment)
+                        return std::string::npos;
+                    *newlines = lines;
+                    return lineStart;
+                }
+                if (directive == "endif")
+                    --depth;
+            } else if (directive == "error" || directive == "warning") {
+                // the message is raw text up to the end of the (spliced) line
+                bool backslash = false;
+                for (i = nameEnd; i < size; ++i) {
+                    if ((str[i] == '\r' || str[i] == '\n') && !backslash)
+                        break;
+                    if (str[i] == '\r' && i + 1U < size && str[i + 1U] == '\n')
+                        ++i;
+                    if (str[i] == '\r' || str[i] == '\n')
+                        ++lines;
+                    backslash = (str[i] == '\\');
+                }
+                nameEnd = i;
+            }
+            inDirective = true;
+            sawToken = true;
+            inName = false;
+            lastChar = '#';
+            pos = nameEnd;
+            continue;
+        }
+
+        if ((ch == '\"' || ch == '\'') && !(ch == '\'' && inName && numberRun && pos + 1U < size && isNameChar(str[pos + 1U]))) {
+            if (ch == '\"' && inName && lastChar == 'R')
+                return std::string::npos;
+            for (++pos; pos < size && str[pos] != ch; ++pos) {
+                if (str[pos] == '\r' || str[pos] == '\n')
+                    return std::string::npos;
+                if (str[pos] == '\\' && pos + 1U < size) {
+                    ++pos;
+                    if (str[pos] == '\r' && pos + 1U < size && str[pos + 1U] == '\n')
+                        ++pos;
+                    if (str[pos] == '\r' || str[pos] == '\n')
+                        ++lines;
+                }
+            }
+            if (pos >= size)
+                return std::string::npos;
+            ++pos;
+            sawToken = true;
+            inName = false;
+            lastChar = ch;
+            continue;
+        }
+
+        if (isNameChar(ch)) {
+            if (!inName)
+                numberRun = std::isdigit(ch) != 0;
+            inName = true;
+        } else if (ch != '\'') {
+            inName = false;
+        }
+        sawToken = true;
+        lastChar = ch;
+        ++pos;
+    }
+    return std::string::npos;
+}
+
 class StdCharBufStream : public simplecpp::TokenList::Stream {
 public:
     // cppcheck-suppress uninitDerivedMemberVar - we call Stream::init() to initialize the private members
@@ -406,6 +594,16 @@ public:
     virtual bool good() OVERRIDE {
         return lastStatus != EOF;
     }
+    virtual bool skipConditionalBlock(std::string &text, unsigned int &newlines) OVERRIDE {
+        if (isUtf16)
+            return false;
+        const std::size_t end = findConditionalBlockEnd(str, size, pos, &newlines);
+        if (end == std::string::npos || end == pos)
+            return false;
+        text.assign(reinterpret_cast<const char *>(str) + pos, end - pos);
+        pos = end;
+        return true;
+    }
 
 private:
     const unsigned char *str;
@@ -468,32 +666,51 @@ private:
     int lastStatus;
 };
 
-simplecpp::TokenList::TokenList(std::vector<std::string> &filenames) : frontToken(nullptr), backToken(nullptr), files(filenames) {}
+simplecpp::TokenList::TokenList(std::vector<std::string> &filenames) : frontToken(nullptr), backToken(nullptr), files(filenames), lazyConditionals(false), lastLineStart(nullptr), lastLineSize(0) {}
 
 simplecpp::TokenList::TokenList(std::istream &istr, std::vector<std::string> &filenames, const std::string &filename, OutputList *outputList)
-    : frontToken(nullptr), backToken(nullptr), files(filenames)
+    : frontToken(nullptr), backToken(nullptr), files(filenames), lazyConditionals(false), lastLineStart(nullptr), lastLineSize(0)
 {
     StdIStream stream(istr);
     readfile(stream,filename,outputList);
 }
 
-simplecpp::TokenList::TokenList(const unsigned char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename, OutputList *outputList)
-    : frontToken(nullptr), backToken(nullptr), files(filenames)
+simplecpp::TokenList::TokenList(const unsigned char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename, OutputList *outputList, bool lazyConditionals)
+    : frontToken(nullptr), backToken(nullptr), files(filenames), lazyConditionals(lazyConditionals), lastLineStart(nullptr), lastLineSize(0)
 {
     StdCharBufStream stream(data, size);
     readfile(stream,filename,outputList);
 }
 
-simplecpp::TokenList::TokenList(const char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename, OutputList *outputList)
-    : frontToken(nullptr), backToken(nullptr), files(filenames)
+simplecpp::TokenList::TokenList(const char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename, OutputList *outputList, bool lazyConditionals)
+    : frontToken(nullptr), backToken(nullptr), files(filenames), lazyConditionals(lazyConditionals), lastLineStart(nullptr), lastLineSize(0)
 {
     StdCharBufStream stream(reinterpret_cast<const unsigned char*>(data), size);
     readfile(stream,filename,outputList);
 }
 
-simplecpp::TokenList::TokenList(const std::string &filename, std::vector<std::string> &filenames, OutputList *outputList)
-    : frontToken(nullptr), backToken(nullptr), files(filenames)
+simplecpp::TokenList::TokenList(const std::string &filename, std::vector<std::string> &filenames, OutputList *outputList, bool lazyConditionals)
+    : frontToken(nullptr), backToken(nullptr), files(filenames), lazyConditionals(lazyConditionals), lastLineStart(nullptr), lastLineSize(0)
 {
+    if (lazyConditionals) {
+        // conditional blocks are skipped at byte level, which needs the whole file in memory
+        std::FILE * const f = std::fopen(filename.c_str(), "rb");
+        if (!f) {
+            filenames.push_back(filename);
+            if (outputList)
+                outputList->push_back(Output(files, Output::FILE_NOT_FOUND, "File is missing: " + filename));
+            return;
+        }
+        std::string data;
+        char buf[65536];
+        std::size_t n;
+        while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0)
+            data.append(buf, n);
+        std::fclose(f);
+        StdCharBufStream stream(reinterpret_cast<const unsigned char *>(data.data()), data.size());
+        readfile(stream, filename, outputList);
+        return;
+    }
     try {
         FileStream stream(filename, filenames);
         readfile(stream,filename,outputList);
@@ -502,13 +719,13 @@ simplecpp::TokenList::TokenList(const std::string &filename, std::vector<std::st
     }
 }
 
-simplecpp::TokenList::TokenList(const TokenList &other) : frontToken(nullptr), backToken(nullptr), files(other.files)
+simplecpp::TokenList::TokenList(const TokenList &other) : frontToken(nullptr), backToken(nullptr), files(other.files), lazyConditionals(false), lastLineStart(nullptr), lastLineSize(0)
 {
     *this = other;
 }
 
 #if __cplusplus >= 201103L
-simplecpp::TokenList::TokenList(TokenList &&other) : frontToken(nullptr), backToken(nullptr), files(other.files)
+simplecpp::TokenList::TokenList(TokenList &&other) : frontToken(nullptr), backToken(nullptr), files(other.files), lazyConditionals(false), lastLineStart(nullptr), lastLineSize(0)
 {
     *this = std::move(other);
 }
@@ -527,6 +744,7 @@ simplecpp::TokenList &simplecpp::TokenList::operator=(const TokenList &other)
         for (const Token *tok = other.cfront(); tok; tok = tok->next)
             push_back(new Token(*tok));
         sizeOfType = other.sizeOfType;
+        lazyConditionals = other.lazyConditionals;
     }
     return *this;
 }
@@ -540,8 +758,10 @@ simplecpp::TokenList &simplecpp::TokenList::operator=(TokenList &&other)
         other.frontToken = nullptr;
         backToken = other.backToken;
         other.backToken = nullptr;
+        lastLineSize = -1;
         files = other.files;
         sizeOfType = std::move(other.sizeOfType);
+        lazyConditionals = other.lazyConditionals;
     }
     return *this;
 }
@@ -555,11 +775,24 @@ void simplecpp::TokenList::clear()
         delete frontToken;
         frontToken = next;
     }
+    lastLineStart = nullptr;
+    lastLineSize = 0;
     sizeOfType.clear();
 }
 
 void simplecpp::TokenList::push_back(Token *tok)
 {
+    if (lastLineSize >= 0) {
+        if (!backToken || !backToken->location.sameline(tok->location)) {
+            lastLineStart = nullptr;
+            lastLineSize = 0;
+        }
+        if (!tok->comment) {
+            if (!lastLineStart)
+                lastLineStart = tok;
+            ++lastLineSize;
+        }
+    }
     if (!frontToken)
         frontToken = tok;
     else
@@ -573,35 +806,50 @@ void simplecpp::TokenList::dump() const
     std::cout << stringify() << std::endl;
 }
 
+class StringOutputSink : public simplecpp::OutputSink {
+public:
+    EXPLICIT StringOutputSink(std::string &str) : str(str) {}
+
+    virtual void write(const char *data, std::size_t size) OVERRIDE {
+        str.append(data, size);
+    }
+
+private:
+    std::string &str;
+};
+
 std::string simplecpp::TokenList::stringify() const
 {
-    std::ostringstream ret;
+    std::string ret;
+    StringOutputSink sink(ret);
+    stringify(sink);
+    return ret;
+}
+
+void simplecpp::TokenList::stringify(OutputSink &sink) const
+{
+    static const char newlines[] = "\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n";
     Location loc(files);
     for (const Token *tok = cfront(); tok; tok = tok->next) {
         if (tok->location.line < loc.line || tok->location.fileIndex != loc.fileIndex) {
-            ret << "\n#line " << tok->location.line << " \"" << tok->location.file() << "\"\n";
+            const std::string line = "\n#line " + toString(tok->location.line) + " \"" + tok->location.file() + "\"\n";
+            sink.write(line.data(), line.size());
             loc = tok->location;
         }
 
         while (tok->location.line > loc.line) {
-            ret << '\n';
-            loc.line++;
+            const unsigned int n = std::min<unsigned int>(tok->location.line - loc.line, sizeof(newlines) - 1U);
+            sink.write(newlines, n);
+            loc.line += n;
         }
 
         if (sameline(tok->previous, tok))
-            ret << ' ';
+            sink.write(" ", 1U);
 
-        ret << tok->str();
+        sink.write(tok->str().data(), tok->str().size());
 
         loc.adjust(tok->str());
     }
-
-    return ret.str();
-}
-
-static bool isNameChar(unsigned char ch)
-{
-    return std::isalnum(ch) || ch == '_' || ch == '$';
 }
 
 static std::string escapeString(const std::string &str)
@@ -654,18 +902,189 @@ void simplecpp::TokenList::lineDirective(unsigned int fileIndex, unsigned int li
 
 static const std::string COMMENT_END("*/");
 
-void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename, OutputList *outputList)
+bool simplecpp::TokenList::readConditionalBlock(Stream &stream, Location *location)
 {
-    std::stack<simplecpp::Location> loc;
+    const Token * const llTok = lastLineTok();
+    if (!llTok || llTok->op != '#' || !llTok->next)
+        return false;
+    const TokenString &directive = llTok->next->str();
+    if (directive != "if" && directive != "ifdef" && directive != "ifndef" && directive != "elif" && directive != "else")
+        return false;
 
-    unsigned int multiline = 0U;
+    std::string text;
+    unsigned int newlines = 0;
+    if (!stream.skipConditionalBlock(text, newlines))
+        return false;
+    Token * const block = new Token(text, *location);
+    block->op = '\0';
+    block->comment = block->name = block->number = false;
+    block->rawBlock = true;
+    push_back(block);
+    location->line += newlines;
+    return true;
+}
 
-    const Token *oldLastToken = nullptr;
+void simplecpp::TokenList::readRawBlock(const Token *block, OutputList *outputList)
+{
+    lazyConditionals = true;
+    StdCharBufStream stream(reinterpret_cast<const unsigned char *>(block->str().data()), block->str().size());
+    Location location(files);
+    location.fileIndex = block->location.fileIndex;
+    location.line = block->location.line;
+    location.col = block->location.col;
+    readStream(stream, location, outputList);
+}
+
+static const char TOKENLIST_IMAGE_MAGIC[4] = { 'S', 'C', 'T', '1' };
+
+static void writeVarUInt(std::string &data, unsigned int value)
+{
+    while (value >= 0x80U) {
+        data += static_cast<char>((value & 0x7fU) | 0x80U);
+        value >>= 7;
+    }
+    data += static_cast<char>(value);
+}
 
+static bool readVarUInt(const unsigned char *&pos, const unsigned char *end, unsigned int &value)
+{
+    value = 0;
+    for (unsigned int shift = 0; shift < 32U; shift += 7U) {
+        if (pos == end)
+            return false;
+        const unsigned char byte = *pos++;
+        value |= static_cast<unsigned int>(byte & 0x7fU) << shift;
+        if ((byte & 0x80U) == 0)
+            return true;
+    }
+    return false;
+}
+
+static bool readString(const unsigned char *&pos, const unsigned char *end, std::string &str)
+{
+    unsigned int size;
+    if (!readVarUInt(pos, end, size) || size > static_cast<std::size_t>(end - pos))
+        return false;
+    str.assign(reinterpret_cast<const char *>(pos), size);
+    pos += size;
+    return true;
+}
+
+void simplecpp::TokenList::serialize(std::string &data) const
+{
+    // strings and file names are interned, tokens refer to them by index
+    std::map<std::string, unsigned int> stringIds;
+    std::vector<const std::string *> strings;
+    std::map<unsigned int, unsigned int> fileIds;
+    std::vector<unsigned int> fileIndexes;
+    unsigned int tokenCount = 0;
+    for (const Token *tok = cfront(); tok; tok = tok->next) {
+        if (stringIds.insert(std::make_pair(tok->str(), static_cast<unsigned int>(strings.size()))).second)
+            strings.push_back(&tok->str());
+        if (fileIds.insert(std::make_pair(tok->location.fileIndex, static_cast<unsigned int>(fileIndexes.size()))).second)
+            fileIndexes.push_back(tok->location.fileIndex);
+        ++tokenCount;
+    }
+
+    data.append(TOKENLIST_IMAGE_MAGIC, sizeof(TOKENLIST_IMAGE_MAGIC));
+    writeVarUInt(data, static_cast<unsigned int>(fileIndexes.size()));
+    for (std::size_t i = 0; i < fileIndexes.size(); ++i) {
+        const std::string &name = fileIndexes[i] < files.size() ? files[fileIndexes[i]] : std::string();
+        writeVarUInt(data, static_cast<unsigned int>(name.size()));
+        data += name;
+    }
+    writeVarUInt(data, static_cast<unsigned int>(strings.size()));
+    for (std::size_t i = 0; i < strings.size(); ++i) {
+        writeVarUInt(data, static_cast<unsigned int>(strings[i]->size()));
+        data += *strings[i];
+    }
+    writeVarUInt(data, tokenCount);
+    for (const Token *tok = cfront(); tok; tok = tok->next) {
+        writeVarUInt(data, stringIds[tok->str()]);
+        writeVarUInt(data, fileIds[tok->location.fileIndex]);
+        writeVarUInt(data, tok->location.line);
+        writeVarUInt(data, tok->location.col);
+        writeVarUInt(data, (tok->whitespaceahead ? 1U : 0U) | (tok->rawBlock ? 2U : 0U));
+    }
+}
+
+bool simplecpp::TokenList::deserialize(const char *data, std::size_t size)
+{
+    clear();
+    const unsigned char *pos = reinterpret_cast<const unsigned char *>(data);
+    const unsigned char * const end = pos + size;
+    if (size < sizeof(TOKENLIST_IMAGE_MAGIC) || std::memcmp(pos, TOKENLIST_IMAGE_MAGIC, sizeof(TOKENLIST_IMAGE_MAGIC)) != 0)
+        return false;
+    pos += sizeof(TOKENLIST_IMAGE_MAGIC);
+
+    unsigned int count;
+    std::vector<unsigned int> fileIndexes;
+    if (!readVarUInt(pos, end, count))
+        return false;
+    for (unsigned int i = 0; i < count; ++i) {
+        std::string name;
+        if (!readString(pos, end, name))
+            return false;
+        fileIndexes.push_back(fileIndex(name));
+    }
+    std::vector<std::string> strings;
+    if (!readVarUInt(pos, end, count))
+        return false;
+    strings.reserve(std::min<std::size_t>(count, static_cast<std::size_t>(end - pos)));
+    for (unsigned int i = 0; i < count; ++i) {
+        strings.push_back(std::string());
+        if (!readString(pos, end, strings.back()))
+            return false;
+    }
+
+    if (!readVarUInt(pos, end, count))
+        return false;
+    Location location(files);
+    for (unsigned int i = 0; i < count; ++i) {
+        unsigned int stringId, fileId, tokenFlags;
+        if (!readVarUInt(pos, end, stringId) || !readVarUInt(pos, end, fileId) ||
+            !readVarUInt(pos, end, location.line) || !readVarUInt(pos, end, location.col) ||
+            !readVarUInt(pos, end, tokenFlags) ||
+            stringId >= strings.size() || fileId >= fileIndexes.size()) {
+            clear();
+            return false;
+        }
+        location.fileIndex = fileIndexes[fileId];
+        Token * const tok = new Token(strings[stringId], location, (tokenFlags & 1U) != 0);
+        if (tokenFlags & 2U) {
+            tok->op = '\0';
+            tok->comment = tok->name = tok->number = false;
+            tok->rawBlock = true;
+        }
+        push_back(tok);
+    }
+    if (pos != end) {
+        clear();
+        return false;
+    }
+    return true;
+}
+
+void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename, OutputList *outputList)
+{
     Location location(files);
     location.fileIndex = fileIndex(filename);
     location.line = 1U;
     location.col  = 1U;
+    readStream(stream, location, outputList);
+}
+
+void simplecpp::TokenList::readStream(Stream &stream, Location location, OutputList *outputList)
+{
+    std::stack<simplecpp::Location> loc;
+
+    unsigned int multiline = 0U;
+
+    const Token *oldLastToken = nullptr;
+
+    // token locations may have been changed since the last push_back()
+    lastLineSize = -1;
+
     while (stream.good()) {
         unsigned char ch = stream.readChar();
         if (!stream.good())
@@ -702,6 +1121,16 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
                 oldLastToken = cback();
                 if (!isLastLinePreprocessor())
                     continue;
+                if (lazyConditionals && !multiline && readConditionalBlock(stream, &location)) {
+                    oldLastToken = cback();
+                    continue;
+                }
+                // only #file, #line, # <num> and #endfile are handled here, don't build the text of other directives
+                const Token *directive = lastLineTok()->next;
+                while (directive && directive->comment)
+                    directive = directive->next;
+                if (!directive || !(directive->number || directive->str() == "file" || directive->str() == "line" || directive->str() == "endfile"))
+                    continue;
                 const std::string lastline(lastLine());
                 if (lastline == "# file %str%") {
                     const Token *strtok = cback();
@@ -773,18 +1202,26 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
 
         // comment
         else if (ch == '/' && stream.peekChar() == '/') {
-            while (stream.good() && ch != '\r' && ch != '\n') {
-                currentToken += ch;
-                ch = stream.readChar();
-            }
-            const std::string::size_type pos = currentToken.find_last_not_of(" \t");
-            if (pos < currentToken.size() - 1U && currentToken[pos] == '\\')
-                portabilityBackslash(outputList, files, location);
-            if (currentToken[currentToken.size() - 1U] == '\\') {
-                ++multiline;
-                currentToken.erase(currentToken.size() - 1U);
-            } else {
+            // a '\' ending the line splices the next line into the comment
+            for (;;) {
+                const std::string::size_type lineStart = currentToken.size();
+                while (stream.good() && ch != '\r' && ch != '\n') {
+                    currentToken += ch;
+                    ch = stream.readChar();
+                }
+                const std::string::size_type pos = currentToken.find_last_not_of(" \t");
+                if (pos != std::string::npos && pos >= lineStart && pos < currentToken.size() - 1U && currentToken[pos] == '\\')
+                    portabilityBackslash(outputList, files, location);
+                if (currentToken.size() > lineStart && currentToken[currentToken.size() - 1U] == '\\') {
+                    ++multiline;
+                    currentToken.erase(currentToken.size() - 1U);
+                    if (!stream.good())
+                        break;
+                    ch = stream.readChar();
+                    continue;
+                }
                 stream.ungetChar();
+                break;
             }
         }
 
@@ -806,7 +1243,8 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
                 currentToken.erase(pos,2);
                 ++multiline;
             }
-            if (multiline || isLastLinePreprocessor()) {
+            // a comment on the line after a directive is not part of it, its newlines count as usual
+            if (multiline || (isLastLinePreprocessor() && cback()->location.line == location.line)) {
                 pos = 0;
                 while ((pos = currentToken.find('\n',pos)) != std::string::npos) {
                     currentToken.erase(pos,1);
@@ -1213,37 +1651,41 @@ void simplecpp::TokenList::constFoldShift(Token *tok)
 static const std::string NOTEQ("not_eq");
 void simplecpp::TokenList::constFoldComparison(Token *tok)
 {
-    for (; tok && tok->op != ')'; tok = tok->next) {
-        if (isAlternativeBinaryOp(tok,NOTEQ))
-            tok->setstr("!=");
+    // relational operators bind tighter than == and !=
+    Token * const tok1 = tok;
+    for (int pass = 0; pass < 2; ++pass) {
+        for (tok = tok1; tok && tok->op != ')'; tok = tok->next) {
+            if (isAlternativeBinaryOp(tok,NOTEQ))
+                tok->setstr("!=");
 
-        if (!tok->startsWithOneOf("<>=!"))
-            continue;
-        if (!tok->previous || !tok->previous->number)
-            continue;
-        if (!tok->next || !tok->next->number)
-            continue;
+            if (!tok->startsWithOneOf("<>=!"))
+                continue;
+            if (!tok->previous || !tok->previous->number)
+                continue;
+            if (!tok->next || !tok->next->number)
+                continue;
 
-        int result;
-        if (tok->str() == "==")
-            result = (stringToLL(tok->previous->str()) == stringToLL(tok->next->str()));
-        else if (tok->str() == "!=")
-            result = (stringToLL(tok->previous->str()) != stringToLL(tok->next->str()));
-        else if (tok->str() == ">")
-            result = (stringToLL(tok->previous->str()) > stringToLL(tok->next->str()));
-        else if (tok->str() == ">=")
-            result = (stringToLL(tok->previous->str()) >= stringToLL(tok->next->str()));
-        else if (tok->str() == "<")
-            result = (stringToLL(tok->previous->str()) < stringToLL(tok->next->str()));
-        else if (tok->str() == "<=")
-            result = (stringToLL(tok->previous->str()) <= stringToLL(tok->next->str()));
-        else
-            continue;
+            int result;
+            if (pass == 1 && tok->str() == "==")
+                result = (stringToLL(tok->previous->str()) == stringToLL(tok->next->str()));
+            else if (pass == 1 && tok->str() == "!=")
+                result = (stringToLL(tok->previous->str()) != stringToLL(tok->next->str()));
+            else if (pass == 0 && tok->str() == ">")
+                result = (stringToLL(tok->previous->str()) > stringToLL(tok->next->str()));
+            else if (pass == 0 && tok->str() == ">=")
+                result = (stringToLL(tok->previous->str()) >= stringToLL(tok->next->str()));
+            else if (pass == 0 && tok->str() == "<")
+                result = (stringToLL(tok->previous->str()) < stringToLL(tok->next->str()));
+            else if (pass == 0 && tok->str() == "<=")
+                result = (stringToLL(tok->previous->str()) <= stringToLL(tok->next->str()));
+            else
+                continue;
 
-        tok = tok->previous;
-        tok->setstr(toString(result));
-        deleteToken(tok->next);
-        deleteToken(tok->next);
+            tok = tok->previous;
+            tok->setstr(toString(result));
+            deleteToken(tok->next);
+            deleteToken(tok->next);
+        }
     }
 }
 
@@ -1287,30 +1729,34 @@ static const std::string AND("and");
 static const std::string OR("or");
 void simplecpp::TokenList::constFoldLogicalOp(Token *tok)
 {
-    for (; tok && tok->op != ')'; tok = tok->next) {
-        if (tok->name) {
-            if (isAlternativeBinaryOp(tok,AND))
-                tok->setstr("&&");
-            else if (isAlternativeBinaryOp(tok,OR))
-                tok->setstr("||");
-        }
-        if (tok->str() != "&&" && tok->str() != "||")
-            continue;
-        if (!tok->previous || !tok->previous->number)
-            continue;
-        if (!tok->next || !tok->next->number)
-            continue;
+    // && binds tighter than ||
+    Token * const tok1 = tok;
+    for (const char *op = "&|"; *op; op++) {
+        for (tok = tok1; tok && tok->op != ')'; tok = tok->next) {
+            if (tok->name) {
+                if (isAlternativeBinaryOp(tok,AND))
+                    tok->setstr("&&");
+                else if (isAlternativeBinaryOp(tok,OR))
+                    tok->setstr("||");
+            }
+            if (tok->str().size() != 2U || tok->str()[0] != *op || tok->str()[1] != *op)
+                continue;
+            if (!tok->previous || !tok->previous->number)
+                continue;
+            if (!tok->next || !tok->next->number)
+                continue;
 
-        int result;
-        if (tok->str() == "||")
-            result = (stringToLL(tok->previous->str()) || stringToLL(tok->next->str()));
-        else /*if (tok->str() == "&&")*/
-            result = (stringToLL(tok->previous->str()) && stringToLL(tok->next->str()));
+            int result;
+            if (*op == '|')
+                result = (stringToLL(tok->previous->str()) || stringToLL(tok->next->str()));
+            else
+                result = (stringToLL(tok->previous->str()) && stringToLL(tok->next->str()));
 
-        tok = tok->previous;
-        tok->setstr(toString(result));
-        deleteToken(tok->next);
-        deleteToken(tok->next);
+            tok = tok->previous;
+            tok->setstr(toString(result));
+            deleteToken(tok->next);
+            deleteToken(tok->next);
+        }
     }
 }
 
@@ -1432,18 +1878,18 @@ std::string simplecpp::TokenList::lastLine(int maxsize) const
 
 const simplecpp::Token* simplecpp::TokenList::lastLineTok(int maxsize) const
 {
-    const Token* prevTok = nullptr;
-    int count = 0;
-    for (const Token *tok = cback(); ; tok = tok->previous) {
-        if (!sameline(tok, cback()))
-            break;
-        if (tok->comment)
-            continue;
-        if (++count > maxsize)
-            return nullptr;
-        prevTok = tok;
+    if (lastLineSize < 0) {
+        // tokens were removed since the last push_back(), count the line again
+        lastLineStart = nullptr;
+        lastLineSize = 0;
+        for (const Token *tok = cback(); sameline(tok, cback()); tok = tok->previous) {
+            if (tok->comment)
+                continue;
+            lastLineStart = tok;
+            ++lastLineSize;
+        }
     }
-    return prevTok;
+    return lastLineSize > maxsize ? nullptr : lastLineStart;
 }
 
 bool simplecpp::TokenList::isLastLinePreprocessor(int maxsize) const
@@ -1463,13 +1909,136 @@ unsigned int simplecpp::TokenList::fileIndex(const std::string &filename)
 }
 
 
-namespace simplecpp {
-    class Macro;
-#if __cplusplus >= 201103L
-    using MacroMap = std::unordered_map<TokenString,Macro>;
-#else
-    typedef std::map<TokenString,Macro> MacroMap;
-#endif
+namespace simplecpp {
+    class Macro;
+
+    /**
+     * Open addressing hash table of macros.
+     *
+     * Nearly every identifier of the preprocessed code is looked up here and
+     * most of them are not macros. A small bitmap keyed by (length, first
+     * character, last character) of all names ever inserted rejects those
+     * without hashing the name. Entries are heap allocated so the address of
+     * a Macro stays valid across rehashes (tokens point at the macro they
+     * were expanded from).
+     */
+    class MacroMap {
+    public:
+        typedef std::pair<const TokenString, Macro> value_type;
+
+        template<class Value, class Map>
+        class basic_iterator {
+        public:
+            basic_iterator() : map(nullptr), index(0) {}
+            basic_iterator(Map *m, std::size_t i) : map(m), index(i) {}
+            template<class V2, class M2>
+            basic_iterator(const basic_iterator<V2, M2> &other) : map(other.map), index(other.index) {}
+
+            Value &operator*() const {
+                return *map->slots[index];
+            }
+            Value *operator->() const {
+                return map->slots[index];
+            }
+            basic_iterator &operator++() {
+                index = map->nextUsed(index + 1U);
+                return *this;
+            }
+            bool operator==(const basic_iterator &other) const {
+                return index == other.index;
+            }
+            bool operator!=(const basic_iterator &other) const {
+                return index != other.index;
+            }
+
+        private:
+            template<class V2, class M2> friend class basic_iterator;
+            friend class MacroMap;
+            Map *map;
+            std::size_t index;
+        };
+        typedef basic_iterator<value_type, MacroMap> iterator;
+        typedef basic_iterator<const value_type, const MacroMap> const_iterator;
+
+        MacroMap() : used(0), tombstones(0) {
+            std::memset(filter, 0, sizeof(filter));
+        }
+        MacroMap(const MacroMap &other);
+        ~MacroMap();
+        MacroMap &operator=(const MacroMap &other);
+
+        iterator begin() {
+            return iterator(this, nextUsed(0));
+        }
+        const_iterator begin() const {
+            return const_iterator(this, nextUsed(0));
+        }
+        iterator end() {
+            return iterator(this, slots.size());
+        }
+        const_iterator end() const {
+            return const_iterator(this, slots.size());
+        }
+        std::size_t size() const {
+            return used;
+        }
+        bool empty() const {
+            return used == 0;
+        }
+
+        iterator find(const TokenString &name) {
+            return iterator(this, findIndex(name));
+        }
+        const_iterator find(const TokenString &name) const {
+            return const_iterator(this, findIndex(name));
+        }
+        std::pair<iterator, bool> insert(const std::pair<TokenString, Macro> &value);
+        std::size_t erase(const TokenString &name);
+        void clear();
+
+    private:
+        template<class V2, class M2> friend class basic_iterator;
+
+        static value_type *tombstone() {
+            return reinterpret_cast<value_type *>(&tombstoneTag);
+        }
+        static std::size_t hashName(const TokenString &name) {
+            // FNV-1a
+            std::size_t h = static_cast<std::size_t>(2166136261U);
+            for (std::string::size_type i = 0; i < name.size(); ++i) {
+                h ^= static_cast<unsigned char>(name[i]);
+                h *= static_cast<std::size_t>(16777619U);
+            }
+            return h;
+        }
+        static unsigned int filterBit(const TokenString &name) {
+            const std::string::size_type len = name.size();
+            const unsigned int first = len ? static_cast<unsigned char>(name[0]) : 0U;
+            const unsigned int last = len ? static_cast<unsigned char>(name[len - 1U]) : 0U;
+            return (static_cast<unsigned int>(len) * 131U + first * 31U + last) & (FILTER_BITS - 1U);
+        }
+        bool mayContain(const TokenString &name) const {
+            const unsigned int bit = filterBit(name);
+            return (filter[bit / 64U] >> (bit % 64U)) & 1U;
+        }
+
+        std::size_t nextUsed(std::size_t i) const {
+            while (i < slots.size() && (slots[i] == nullptr || slots[i] == tombstone()))
+                ++i;
+            return i;
+        }
+        std::size_t findIndex(const TokenString &name) const;
+        void rehash(std::size_t capacity);
+
+        enum { FILTER_BITS = 2048 };
+        static char tombstoneTag;
+
+        std::vector<value_type *> slots;
+        std::vector<std::size_t> hashes;
+        std::size_t used;
+        std::size_t tombstones;
+        unsigned long long filter[FILTER_BITS / 64];
+    };
 
     class Macro {
     public:
@@ -2329,6 +2898,108 @@ namespace simplecpp {
         /** was the value of this macro actually defined in the code? */
         bool valueDefinedInCode_;
     };
+
+    char MacroMap::tombstoneTag;
+
+    MacroMap::MacroMap(const MacroMap &other) : used(0), tombstones(0) {
+        std::memset(filter, 0, sizeof(filter));
+        for (const_iterator it = other.begin(); it != other.end(); ++it)
+            insert(std::pair<TokenString, Macro>(it->first, it->second));
+    }
+
+    MacroMap::~MacroMap() {
+        clear();
+    }
+
+    MacroMap &MacroMap::operator=(const MacroMap &other) {
+        if (this != &other) {
+            clear();
+            for (const_iterator it = other.begin(); it != other.end(); ++it)
+                insert(std::pair<TokenString, Macro>(it->first, it->second));
+        }
+        return *this;
+    }
+
+    std::size_t MacroMap::findIndex(const TokenString &name) const {
+        if (used == 0 || !mayContain(name))
+            return slots.size();
+        const std::size_t h = hashName(name);
+        const std::size_t mask = slots.size() - 1U;
+        for (std::size_t i = h & mask;; i = (i + 1U) & mask) {
+            const value_type *slot = slots[i];
+            if (slot == nullptr)
+                return slots.size();
+            if (slot != tombstone() && hashes[i] == h && slot->first == name)
+                return i;
+        }
+    }
+
+    std::pair<MacroMap::iterator, bool> MacroMap::insert(const std::pair<TokenString, Macro> &value) {
+        const std::size_t existing = findIndex(value.first);
+        if (existing != slots.size())
+            return std::make_pair(iterator(this, existing), false);
+        // keep the load factor (including tombstones) below 1/2
+        if ((used + tombstones + 1U) * 2U > slots.size())
+            rehash(used + 1U);
+        const std::size_t h = hashName(value.first);
+        const std::size_t mask = slots.size() - 1U;
+        std::size_t i = h & mask;
+        while (slots[i] != nullptr && slots[i] != tombstone())
+            i = (i + 1U) & mask;
+        if (slots[i] == tombstone())
+            --tombstones;
+        slots[i] = new value_type(value.first, value.second);
+        hashes[i] = h;
+        ++used;
+        const unsigned int bit = filterBit(value.first);
+        filter[bit / 64U] |= 1ULL << (bit % 64U);
+        return std::make_pair(iterator(this, i), true);
+    }
+
+    std::size_t MacroMap::erase(const TokenString &name) {
+        const std::size_t i = findIndex(name);
+        if (i == slots.size())
+            return 0;
+        delete slots[i];
+        slots[i] = tombstone();
+        --used;
+        ++tombstones;
+        // the filter bit is left set, a stale bit only costs a hash probe
+        return 1;
+    }
+
+    void MacroMap::clear() {
+        for (std::size_t i = 0; i < slots.size(); ++i) {
+            if (slots[i] != tombstone())
+                delete slots[i];
+        }
+        slots.clear();
+        hashes.clear();
+        used = 0;
+        tombstones = 0;
+        std::memset(filter, 0, sizeof(filter));
+    }
+
+    void MacroMap::rehash(std::size_t capacity) {
+        std::size_t newSize = 16U;
+        while (newSize < capacity * 2U)
+            newSize *= 2U;
+        std::vector<value_type *> oldSlots(newSize, static_cast<value_type *>(nullptr));
+        std::vector<std::size_t> oldHashes(newSize, 0U);
+        oldSlots.swap(slots);
+        oldHashes.swap(hashes);
+        const std::size_t mask = newSize - 1U;
+        for (std::size_t j = 0; j < oldSlots.size(); ++j) {
+            if (oldSlots[j] == nullptr || oldSlots[j] == tombstone())
+                continue;
+            std::size_t i = oldHashes[j] & mask;
+            while (slots[i] != nullptr)
+                i = (i + 1U) & mask;
+            slots[i] = oldSlots[j];
+            hashes[i] = oldHashes[j];
+        }
+        tombstones = 0;
+    }
 }
 
 namespace simplecpp {
@@ -2681,7 +3352,7 @@ static bool isCpp17OrLater(const simplecpp::DUI &dui)
     return !std_ver.empty() && (std_ver >= "201703L");
 }
 
-static std::string openHeader(std::ifstream &f, const simplecpp::DUI &dui, const std::string &sourcefile, const std::string &header, bool systemheader);
+static std::string openHeader(const simplecpp::DUI &dui, const std::string &sourcefile, const std::string &header, bool systemheader);
 static void simplifyHasInclude(simplecpp::TokenList &expr, const simplecpp::DUI &dui)
 {
     if (!isCpp17OrLater(dui))
@@ -2730,8 +3401,7 @@ static void simplifyHasInclude(simplecpp::TokenList &expr, const simplecpp::DUI
         } else {
             header = realFilename(tok1->str().substr(1U, tok1->str().size() - 2U));
         }
-        std::ifstream f;
-        const std::string header2 = openHeader(f,dui,sourcefile,header,systemheader);
+        const std::string header2 = openHeader(dui,sourcefile,header,systemheader);
         tok->setstr(header2.empty() ? "0" : "1");
 
         tok2 = tok2->next;
@@ -3042,6 +3712,222 @@ static long long evaluate(simplecpp::TokenList &expr, const simplecpp::DUI &dui,
     return expr.cfront() && expr.cfront() == expr.cback() && expr.cfront()->number ? stringToLL(expr.cfront()->str()) : 0LL;
 }
 
+/**
+ * Precedence climbing evaluator for macro expanded #if expressions.
+ *
+ * Works on the tokens as they are, without copying or rewriting them. Only
+ * integer and character literal expressions are handled; anything else (sizeof,
+ * alternative operator spellings, comments, division by zero, ...) fails so
+ * evaluate() can report it or fold it. Both follow C precedence.
+ */
+class ConstantEvaluator {
+public:
+    explicit ConstantEvaluator(const simplecpp::Token *start) : tok(start), ok(true) {}
+
+    bool run(long long &result) {
+        result = expression(0);
+        return ok && !tok;
+    }
+
+private:
+    enum {
+        PREC_CONDITIONAL = 1, PREC_LOGICAL_OR, PREC_LOGICAL_AND, PREC_BITWISE_OR, PREC_BITWISE_XOR,
+        PREC_BITWISE_AND, PREC_EQUALITY, PREC_RELATIONAL, PREC_SHIFT, PREC_ADDITIVE, PREC_MULTIPLICATIVE
+    };
+
+    static int binaryPrecedence(const simplecpp::Token *tok) {
+        const std::string &s = tok->str();
+        if (s.size() == 1U) {
+            switch (s[0]) {
+            case '?':
+                return PREC_CONDITIONAL;
+            case '|':
+                return PREC_BITWISE_OR;
+            case '^':
+                return PREC_BITWISE_XOR;
+            case '&':
+                return PREC_BITWISE_AND;
+            case '<':
+            case '>':
+                return PREC_RELATIONAL;
+            case '+':
+            case '-':
+                return PREC_ADDITIVE;
+            case '*':
+            case '/':
+            case '%':
+                return PREC_MULTIPLICATIVE;
+            }
+        } else if (s.size() == 2U) {
+            if (s == "||")
+                return PREC_LOGICAL_OR;
+            if (s == "&&")
+                return PREC_LOGICAL_AND;
+            if (s == "==" || s == "!=")
+                return PREC_EQUALITY;
+            if (s == "<=" || s == ">=")
+                return PREC_RELATIONAL;
+            if (s == "<<" || s == ">>")
+                return PREC_SHIFT;
+        }
+        return 0;
+    }
+
+    long long fail() {
+        ok = false;
+        tok = nullptr;
+        return 0;
+    }
+
+    long long number(const std::string &s) {
+        unsigned long long value = 0;
+        unsigned int base = 10;
+        std::string::size_type pos = 0;
+        if (isHex(s)) {
+            base = 16;
+            pos = 2;
+        } else if (s.size() > 1U && s[0] == '0') {
+            base = 8;
+            pos = 1;
+        }
+        for (; pos < s.size(); ++pos) {
+            const char c = s[pos];
+            unsigned int digit;
+            if (c >= '0' && c <= '9')
+                digit = c - '0';
+            else if (base == 16 && c >= 'a' && c <= 'f')
+                digit = c - 'a' + 10;
+            else if (base == 16 && c >= 'A' && c <= 'F')
+                digit = c - 'A' + 10;
+            else
+                break;
+            if (digit >= base || value > (static_cast<unsigned long long>(std::numeric_limits<long long>::max()) - digit) / base)
+                return fail();
+            value = value * base + digit;
+        }
+        if ((base == 16 && pos == 2U) || s.find_first_not_of("uUlL", pos) != std::string::npos)
+            return fail();
+        return static_cast<long long>(value);
+    }
+
+    long long unary() {
+        if (!tok)
+            return fail();
+        const simplecpp::Token * const t = tok;
+        tok = tok->next;
+        if (t->number)
+            return number(t->str());
+        if (t->str().size() > 1U && t->str().find('\'') != std::string::npos) {
+            // same conversion as simplifyNumbers()
+            try {
+                return simplecpp::characterLiteralToLL(t->str());
+            } catch (const std::runtime_error &) {
+                return fail();
+            }
+        }
+        if (t->name) {
+            // names left after macro expansion are 0, see simplifyName()
+            if (t->str() == "sizeof" || altop.find(t->str()) != altop.end())
+                return fail();
+            return 0;
+        }
+        long long value;
+        switch (t->op) {
+        case '(':
+            value = expression(0);
+            if (!tok || tok->op != ')')
+                return fail();
+            tok = tok->next;
+            return value;
+        case '!':
+            return !unary();
+        case '~':
+            return ~unary();
+        case '+':
+            return unary();
+        case '-':
+            return static_cast<long long>(0ULL - static_cast<unsigned long long>(unary()));
+        }
+        return fail();
+    }
+
+    long long expression(int minPrecedence) {
+        long long lhs = unary();
+        while (tok) {
+            const int precedence = binaryPrecedence(tok);
+            if (precedence == 0 || precedence < minPrecedence)
+                break;
+            const std::string &op = tok->str();
+            tok = tok->next;
+            if (precedence == PREC_CONDITIONAL) {
+                const long long second = expression(0);
+                if (!tok || tok->op != ':')
+                    return fail();
+                tok = tok->next;
+                const long long third = expression(PREC_CONDITIONAL);
+                lhs = lhs ? second : third;
+                continue;
+            }
+            const long long rhs = expression(precedence + 1);
+            if (!ok)
+                return 0;
+            const unsigned long long ul = static_cast<unsigned long long>(lhs);
+            const unsigned long long ur = static_cast<unsigned long long>(rhs);
+            if (op == "||")
+                lhs = lhs || rhs;
+            else if (op == "&&")
+                lhs = lhs && rhs;
+            else if (op == "|")
+                lhs = lhs | rhs;
+            else if (op == "^")
+                lhs = lhs ^ rhs;
+            else if (op == "&")
+                lhs = lhs & rhs;
+            else if (op == "==")
+                lhs = lhs == rhs;
+            else if (op == "!=")
+                lhs = lhs != rhs;
+            else if (op == "<")
+                lhs = lhs < rhs;
+            else if (op == "<=")
+                lhs = lhs <= rhs;
+            else if (op == ">")
+                lhs = lhs > rhs;
+            else if (op == ">=")
+                lhs = lhs >= rhs;
+            else if (op == "<<" || op == ">>") {
+                if (rhs < 0 || rhs >= 64 || (op == "<<" && lhs < 0))
+                    return fail();
+                lhs = op == "<<" ? static_cast<long long>(ul << rhs) : (lhs >> rhs);
+            } else if (op == "+")
+                lhs = static_cast<long long>(ul + ur);
+            else if (op == "-")
+                lhs = static_cast<long long>(ul - ur);
+            else if (op == "*")
+                lhs = static_cast<long long>(ul * ur);
+            else {
+                // division by zero and overflow are reported by evaluate()
+                if (rhs == 0 || (rhs == -1 && lhs == std::numeric_limits<long long>::min()))
+                    return fail();
+                lhs = op == "/" ? lhs / rhs : lhs % rhs;
+            }
+        }
+        return ok ? lhs : 0;
+    }
+
+    const simplecpp::Token *tok;
+    bool ok;
+};
+
+/** evaluate a macro expanded #if expression, with evaluate() as fallback */
+static long long evaluateCondition(simplecpp::TokenList &expr, const simplecpp::DUI &dui, const std::map<std::string, std::size_t> &sizeOfType)
+{
+    long long result;
+    if (ConstantEvaluator(expr.cfront()).run(result))
+        return result;
+    return evaluate(expr, dui, sizeOfType);
+}
+
 static const simplecpp::Token *gotoNextLine(const simplecpp::Token *tok)
 {
     const unsigned int line = tok->location.line;
@@ -3051,49 +3937,80 @@ static const simplecpp::Token *gotoNextLine(const simplecpp::Token *tok)
     return tok;
 }
 
-#ifdef SIMPLECPP_WINDOWS
-
-class NonExistingFilesCache {
+/**
+ * Caches the results of header lookups.
+ *
+ * Every preprocessing thread owns its own instance, so neither the negative
+ * cache (paths known not to exist) nor the positive cache ((includer dir,
+ * header spelling, system flag) => resolved path) needs any locking, and
+ * parallel preprocessing never serializes on filesystem probes.
+ */
+class HeaderLookupCache {
 public:
-    NonExistingFilesCache() {}
+    HeaderLookupCache() {}
+
+    /** drop cached results if requested or if the include paths changed */
+    void prepare(const simplecpp::DUI &dui) {
+        if (dui.clearIncludeCache || m_includePaths != dui.includePaths) {
+            m_nonExisting.clear();
+            m_resolved.clear();
+            m_includePaths = dui.includePaths;
+        }
+    }
 
-    bool contains(const std::string& path) {
-        MyLock<MyMutex> lock(m_mutex);
-        return (m_pathSet.find(path) != m_pathSet.end());
+    bool nonExisting(const std::string &path) const {
+        return m_nonExisting.find(path) != m_nonExisting.end();
     }
 
-    void add(const std::string& path) {
-        MyLock<MyMutex> lock(m_mutex);
-        m_pathSet.insert(path);
+    void addNonExisting(const std::string &path) {
+        m_nonExisting.insert(path);
     }
 
-    void clear() {
-        MyLock<MyMutex> lock(m_mutex);
-        m_pathSet.clear();
+    /** @return resolved path ("" if the header was not found), or nullptr if not cached */
+    const std::string *resolved(const std::string &key) const {
+        const ResolvedMap::const_iterator it = m_resolved.find(key);
+        return it != m_resolved.end() ? &it->second : nullptr;
+    }
+
+    void addResolved(const std::string &key, const std::string &path) {
+        m_resolved[key] = path;
     }
 
 private:
-    std::set<std::string> m_pathSet;
-    MyMutex m_mutex;
+#if __cplusplus >= 201103L
+    typedef std::unordered_set<std::string> PathSet;
+    typedef std::unordered_map<std::string, std::string> ResolvedMap;
+#else
+    typedef std::set<std::string> PathSet;
+    typedef std::map<std::string, std::string> ResolvedMap;
+#endif
+    PathSet m_nonExisting;
+    ResolvedMap m_resolved;
+    std::list<std::string> m_includePaths;
 };
 
-static NonExistingFilesCache nonExistingFilesCache;
-
+static HeaderLookupCache &headerLookupCache()
+{
+#if __cplusplus >= 201103L
+    static thread_local HeaderLookupCache cache;
+#else
+    static HeaderLookupCache cache;
 #endif
+    return cache;
+}
 
-static std::string openHeader(std::ifstream &f, const std::string &path)
+static std::string openHeader(const std::string &path)
 {
     std::string simplePath = simplecpp::simplifyPath(path);
-#ifdef SIMPLECPP_WINDOWS
-    if (nonExistingFilesCache.contains(simplePath))
+    HeaderLookupCache &cache = headerLookupCache();
+    if (cache.nonExisting(simplePath))
         return "";  // file is known not to exist, skip expensive file open call
-#endif
-    f.open(simplePath.c_str());
-    if (f.is_open())
+    std::FILE * const f = std::fopen(simplePath.c_str(), "rb");
+    if (f) {
+        std::fclose(f);
         return simplePath;
-#ifdef SIMPLECPP_WINDOWS
-    nonExistingFilesCache.add(simplePath);
-#endif
+    }
+    cache.addNonExisting(simplePath);
     return "";
 }
 
@@ -3104,9 +4021,9 @@ static std::string getRelativeFileName(const std::string &sourcefile, const std:
     return simplecpp::simplifyPath(header);
 }
 
-static std::string openHeaderRelative(std::ifstream &f, const std::string &sourcefile, const std::string &header)
+static std::string openHeaderRelative(const std::string &sourcefile, const std::string &header)
 {
-    return openHeader(f, getRelativeFileName(sourcefile, header));
+    return openHeader(getRelativeFileName(sourcefile, header));
 }
 
 static std::string getIncludePathFileName(const std::string &includePath, const std::string &header)
@@ -3117,31 +4034,43 @@ static std::string getIncludePathFileName(const std::string &includePath, const
     return path + header;
 }
 
-static std::string openHeaderIncludePath(std::ifstream &f, const simplecpp::DUI &dui, const std::string &header)
+static std::string openHeaderIncludePath(const simplecpp::DUI &dui, const std::string &header)
 {
     for (std::list<std::string>::const_iterator it = dui.includePaths.begin(); it != dui.includePaths.end(); ++it) {
-        std::string simplePath = openHeader(f, getIncludePathFileName(*it, header));
+        std::string simplePath = openHeader(getIncludePathFileName(*it, header));
         if (!simplePath.empty())
             return simplePath;
     }
     return "";
 }
 
-static std::string openHeader(std::ifstream &f, const simplecpp::DUI &dui, const std::string &sourcefile, const std::string &header, bool systemheader)
+/** @return path of the header, or "" if it can't be found */
+static std::string openHeader(const simplecpp::DUI &dui, const std::string &sourcefile, const std::string &header, bool systemheader)
 {
-    if (isAbsolutePath(header))
-        return openHeader(f, header);
+    // relative lookups only depend on the directory of the includer
+    std::string key;
+    const std::string::size_type sep = sourcefile.find_last_of("\\/");
+    if (sep != std::string::npos)
+        key.assign(sourcefile, 0, sep + 1U);
+    key += '\0';
+    key += header;
+    key += systemheader ? '<' : '"';
+
+    HeaderLookupCache &cache = headerLookupCache();
+    if (const std::string *cached = cache.resolved(key))
+        return *cached;
 
     std::string ret;
-
-    if (systemheader) {
-        ret = openHeaderIncludePath(f, dui, header);
-        return ret;
+    if (isAbsolutePath(header))
+        ret = openHeader(header);
+    else if (systemheader)
+        ret = openHeaderIncludePath(dui, header);
+    else {
+        ret = openHeaderRelative(sourcefile, header);
+        if (ret.empty())
+            ret = openHeaderIncludePath(dui, header);
     }
-
-    ret = openHeaderRelative(f, sourcefile, header);
-    if (ret.empty())
-        return openHeaderIncludePath(f, dui, header);
+    cache.addResolved(key, ret);
     return ret;
 }
 
@@ -3177,12 +4106,203 @@ static bool hasFile(const std::map<std::string, simplecpp::TokenList *> &filedat
     return !getFileName(filedata, sourcefile, header, dui, systemheader).empty();
 }
 
+/** tokenize a header or -include file, through DUI::headerLoader if there is one */
+static simplecpp::TokenList *readHeader(const std::string &path, std::vector<std::string> &filenames, const simplecpp::DUI &dui, simplecpp::OutputList *outputList)
+{
+    simplecpp::TokenList *tokens = dui.headerLoader ? dui.headerLoader->load(path, filenames, dui, outputList) : nullptr;
+    if (!tokens)
+        tokens = new simplecpp::TokenList(path, filenames, outputList, dui.lazyConditionals);
+    if (dui.removeComments)
+        tokens->removeComments();
+    return tokens;
+}
+
+/** resolve an included header for simplecpp::load(), and queue it for reading unless it is known already */
+static void queueHeader(std::map<std::string, simplecpp::TokenList*> &ret, std::list<std::string> &pending, const std::string &sourcefile, const std::string &header, const simplecpp::DUI &dui, bool systemheader)
+{
+    if (hasFile(ret, sourcefile, header, dui, systemheader))
+        return;
+    const std::string header2 = openHeader(dui,sourcefile,header,systemheader);
+    if (header2.empty() || ret.find(header2) != ret.end())
+        return;
+    ret[header2] = nullptr;
+    pending.push_back(header2);
+    if (dui.headerLoader)
+        dui.headerLoader->prefetch(header2, dui);
+}
+
+/**
+ * What simplecpp::load() can tell about a macro before preprocessing: 1 defined, 0 undefined, -1 unknown.
+ * Only -D macros and names reserved for the implementation (_WIN32, __clang__, ...) that no #define or #undef
+ * seen so far touches are known. It is a prefetch hint, preprocess() still decides.
+ */
+static int knownDefined(const std::string &name, const simplecpp::DUI &dui, const std::set<std::string> &touched)
+{
+    if (touched.find(name) != touched.end())
+        return -1;
+    if (dui.undefined.find(name) == dui.undefined.end()) {
+        for (std::list<std::string>::const_iterator it = dui.defines.begin(); it != dui.defines.end(); ++it) {
+            if (it->compare(0, name.size(), name) == 0 && (it->size() == name.size() || (*it)[name.size()] == '=' || (*it)[name.size()] == '('))
+                return 1;
+        }
+    }
+    static const char * const builtins[] = { "__FILE__", "__LINE__", "__COUNTER__", "__DATE__", "__TIME__", "__STDC_VERSION__", "__cplusplus", "__has_include" };
+    for (std::size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+        if (name == builtins[i])
+            return -1;
+    }
+    if (name.size() >= 2U && name[0] == '_' && (name[1] == '_' || std::isupper(static_cast<unsigned char>(name[1]))))
+        return 0;
+    return -1;
+}
+
+/** value of a #if, #ifdef or #ifndef condition known before preprocessing: 1 true, 0 false, -1 unknown */
+static int knownCondition(const std::string &directive, const std::string &expr, const simplecpp::DUI &dui, const std::set<std::string> &touched)
+{
+    // a trailing comment
+    const std::string cond = expr.substr(0, expr.find('/'));
+    std::string::size_type pos = cond.find_first_not_of(" \t\r");
+    if (pos == std::string::npos)
+        return -1;
+    std::string::size_type end = cond.find_last_not_of(" \t\r") + 1U;
+    bool negate = (directive == IFNDEF);
+    if (directive == IF) {
+        if (cond.compare(pos, end - pos, "0") == 0)
+            return 0;
+        if (cond.compare(pos, end - pos, "1") == 0)
+            return 1;
+        // [!] defined X, [!] defined(X)
+        if (cond[pos] == '!') {
+            negate = true;
+            pos = cond.find_first_not_of(" \t", pos + 1U);
+        }
+        if (pos == std::string::npos || cond.compare(pos, DEFINED.size(), DEFINED) != 0 || (pos + DEFINED.size() < end && isNameChar(cond[pos + DEFINED.size()])))
+            return -1;
+        pos = cond.find_first_not_of(" \t", pos + DEFINED.size());
+        if (pos == std::string::npos)
+            return -1;
+        if (cond[pos] == '(') {
+            if (cond[end - 1U] != ')')
+                return -1;
+            end = cond.find_last_not_of(" \t", end - 2U) + 1U;
+            pos = cond.find_first_not_of(" \t", pos + 1U);
+            if (pos == std::string::npos || pos >= end)
+                return -1;
+        }
+    } else if (directive != IFDEF && directive != IFNDEF) {
+        return -1;
+    }
+    const std::string name = cond.substr(pos, end - pos);
+    if (std::isdigit(static_cast<unsigned char>(name[0])))
+        return -1;
+    for (std::string::size_type i = 0; i < name.size(); ++i) {
+        if (!isNameChar(name[i]))
+            return -1;
+    }
+    const int defined = knownDefined(name, dui, touched);
+    if (defined < 0)
+        return -1;
+    return negate ? 1 - defined : defined;
+}
+
+/** '#' of the directive line that ends right before tok, nullptr if there is none */
+static const simplecpp::Token *directiveBefore(const simplecpp::Token *tok)
+{
+    const simplecpp::Token *hash = tok->previous;
+    if (!hash)
+        return nullptr;
+    while (hash->previous && sameline(hash->previous, hash))
+        hash = hash->previous;
+    if (hash->op != '#' || !hash->next || !sameline(hash, hash->next))
+        return nullptr;
+    return hash;
+}
+
+/** known value of the condition opening the branch of a rawBlock token, see knownCondition() */
+static int knownBranch(const simplecpp::Token *block, const simplecpp::DUI &dui, const std::set<std::string> &touched)
+{
+    const simplecpp::Token * const hash = directiveBefore(block);
+    if (!hash)
+        return -1;
+    std::string expr;
+    for (const simplecpp::Token *tok = hash->next->next; tok && tok != block; tok = tok->next)
+        expr += ' ' + tok->str();
+    return knownCondition(hash->next->str(), expr, dui, touched);
+}
+
+/** true if the branch a rawBlock token holds is known not to be taken */
+static bool rawBlockKnownInactive(const simplecpp::Token *block, const simplecpp::DUI &dui, const std::set<std::string> &touched)
+{
+    const simplecpp::Token * const hash = directiveBefore(block);
+    if (!hash)
+        return false;
+    const simplecpp::TokenString &directive = hash->next->str();
+    if (directive == ELSE || directive == ELIF) {
+        // the #if branch right before is known to be taken
+        const simplecpp::Token * const prev = hash->previous;
+        return prev && prev->rawBlock && knownBranch(prev, dui, touched) == 1;
+    }
+    return knownBranch(block, dui, touched) == 0;
+}
+
+/**
+ * include directives in the source text of a rawBlock token, found by a plain line scan; includes of nested
+ * branches known not to be taken are left out. The names of #define and #undef lines are added to touched.
+ */
+static void rawBlockIncludes(const std::string &text, const simplecpp::DUI &dui, std::set<std::string> &touched, std::vector<std::pair<std::string, bool> > &includes)
+{
+    // per nested conditional: whether a branch before is known to be taken, whether the current one is known not to be
+    std::vector<std::pair<bool, bool> > levels;
+    for (std::string::size_type pos = 0; pos < text.size(); pos = text.find('\n', pos), pos = (pos == std::string::npos) ? pos : pos + 1U) {
+        pos = text.find_first_not_of(" \t\r", pos);
+        if (pos == std::string::npos || text[pos] != '#')
+            continue;
+        pos = text.find_first_not_of(" \t", pos + 1U);
+        if (pos == std::string::npos)
+            continue;
+        std::string::size_type nameEnd = pos;
+        while (nameEnd < text.size() && isNameChar(text[nameEnd]))
+            ++nameEnd;
+        const std::string directive = text.substr(pos, nameEnd - pos);
+        std::string::size_type lineEnd = text.find_first_of("\r\n", nameEnd);
+        if (lineEnd == std::string::npos)
+            lineEnd = text.size();
+        if (directive == IF || directive == IFDEF || directive == IFNDEF) {
+            const int cond = knownCondition(directive, text.substr(nameEnd, lineEnd - nameEnd), dui, touched);
+            levels.push_back(std::make_pair(cond == 1, cond == 0));
+        } else if (directive == ELIF || directive == ELSE) {
+            if (!levels.empty())
+                levels.back().second = levels.back().first;
+        } else if (directive == ENDIF) {
+            if (!levels.empty())
+                levels.pop_back();
+        } else if (directive == DEFINE || directive == UNDEF) {
+            pos = text.find_first_not_of(" \t", nameEnd);
+            nameEnd = pos;
+            while (nameEnd < lineEnd && isNameChar(text[nameEnd]))
+                ++nameEnd;
+            if (pos < nameEnd)
+                touched.insert(text.substr(pos, nameEnd - pos));
+        } else if (directive == INCLUDE) {
+            bool inactive = false;
+            for (std::size_t i = 0; i < levels.size(); ++i)
+                inactive |= levels[i].second;
+            pos = text.find_first_not_of(" \t", nameEnd);
+            if (inactive || pos == std::string::npos || (text[pos] != '\"' && text[pos] != '<'))
+                continue;
+            const char endChar = text[pos] == '<' ? '>' : '\"';
+            const std::string::size_type end = text.find_first_of(std::string(1, endChar) + "\r\n", pos + 1U);
+            if (end == std::string::npos || text[end] != endChar)
+                continue;
+            includes.push_back(std::make_pair(realFilename(text.substr(pos + 1U, end - pos - 1U)), endChar == '>'));
+            pos = end;
+        }
+    }
+}
+
 std::map<std::string, simplecpp::TokenList*> simplecpp::load(const simplecpp::TokenList &rawtokens, std::vector<std::string> &filenames, const simplecpp::DUI &dui, simplecpp::OutputList *outputList)
 {
-#ifdef SIMPLECPP_WINDOWS
-    if (dui.clearIncludeCache)
-        nonExistingFilesCache.clear();
-#endif
+    headerLookupCache().prepare(dui);
 
     std::map<std::string, simplecpp::TokenList*> ret;
 
@@ -3208,28 +4328,65 @@ std::map<std::string, simplecpp::TokenList*> simplecpp::load(const simplecpp::To
         }
         fin.close();
 
-        TokenList *tokenlist = new TokenList(filename, filenames, outputList);
+        TokenList *tokenlist = readHeader(filename, filenames, dui, outputList);
         if (!tokenlist->front()) {
             delete tokenlist;
             continue;
         }
 
-        if (dui.removeComments)
-            tokenlist->removeComments();
         ret[filename] = tokenlist;
         filelist.push_back(tokenlist->front());
     }
 
-    for (const Token *rawtok = rawtokens.cfront(); rawtok || !filelist.empty(); rawtok = rawtok ? rawtok->next : nullptr) {
+    // Headers are resolved as soon as their #include is seen and handed to DUI::headerLoader for
+    // prefetching. They are read once the walk over the current file is done, so lexing them can
+    // overlap with the walk. ret holds nullptr for them until then, which also deduplicates them.
+    std::list<std::string> pending;
+    // macros #defined or #undefined in what was walked so far, their state is not known before preprocessing
+    std::set<std::string> touched;
+
+    for (const Token *rawtok = rawtokens.cfront(); rawtok || !filelist.empty() || !pending.empty(); rawtok = rawtok ? rawtok->next : nullptr) {
         if (rawtok == nullptr) {
+            for (std::list<std::string>::const_iterator it = pending.begin(); it != pending.end(); ++it) {
+                TokenList * const tokens = readHeader(*it, filenames, dui, outputList);
+                ret[*it] = tokens;
+                if (tokens->front())
+                    filelist.push_back(tokens->front());
+            }
+            pending.clear();
+            if (filelist.empty())
+                break;
             rawtok = filelist.back();
             filelist.pop_back();
         }
 
+        if (rawtok->rawBlock) {
+            // the block may be inactive, so its headers are only prefetched and preprocess() loads them on demand;
+            // blocks known not to be taken, like the _WIN32 half of a platform switch, are not prefetched at all
+            if (!dui.headerLoader || rawBlockKnownInactive(rawtok, dui, touched))
+                continue;
+            std::vector<std::pair<std::string, bool> > includes;
+            rawBlockIncludes(rawtok->str(), dui, touched, includes);
+            for (std::size_t i = 0; i < includes.size(); ++i) {
+                if (hasFile(ret, rawtok->location.file(), includes[i].first, dui, includes[i].second))
+                    continue;
+                const std::string header2 = openHeader(dui, rawtok->location.file(), includes[i].first, includes[i].second);
+                if (!header2.empty())
+                    dui.headerLoader->prefetch(header2, dui);
+            }
+            continue;
+        }
+
         if (rawtok->op != '#' || sameline(rawtok->previousSkipComments(), rawtok))
             continue;
 
         rawtok = rawtok->nextSkipComments();
+        if (rawtok && (rawtok->str() == DEFINE || rawtok->str() == UNDEF)) {
+            const Token * const nameTok = rawtok->nextSkipComments();
+            if (nameTok && nameTok->name && sameline(rawtok, nameTok))
+                touched.insert(nameTok->str());
+            continue;
+        }
         if (!rawtok || rawtok->str() != INCLUDE)
             continue;
 
@@ -3241,34 +4398,203 @@ std::map<std::string, simplecpp::TokenList*> simplecpp::load(const simplecpp::To
 
         const bool systemheader = (htok->str()[0] == '<');
         const std::string header(realFilename(htok->str().substr(1U, htok->str().size() - 2U)));
-        if (hasFile(ret, sourcefile, header, dui, systemheader))
-            continue;
-
-        std::ifstream f;
-        const std::string header2 = openHeader(f,dui,sourcefile,header,systemheader);
-        if (!f.is_open())
-            continue;
-        f.close();
-
-        TokenList *tokens = new TokenList(header2, filenames, outputList);
-        if (dui.removeComments)
-            tokens->removeComments();
-        ret[header2] = tokens;
-        if (tokens->front())
-            filelist.push_back(tokens->front());
+        queueHeader(ret, pending, sourcefile, header, dui, systemheader);
     }
 
     return ret;
 }
 
-static bool preprocessToken(simplecpp::TokenList &output, const simplecpp::Token **tok1, simplecpp::MacroMap &macros, std::vector<std::string> &files, simplecpp::OutputList *outputList)
+/**
+ * Expansions of macro invocations already done by preprocess(), keyed by the text of the invocation.
+ * Only expansions that depend on nothing but that text are stored: every token must be at the location
+ * of the invocation, the rescan at the end of Macro::expand() must not reach the tokens after it, and
+ * __COUNTER__, __FILE__ and __LINE__ must not be involved. Every #define and #undef clears the cache.
+ */
+class ExpansionCache {
+public:
+    explicit ExpansionCache(std::vector<std::string> &f) : files(f) {}
+    ~ExpansionCache() {
+        clear();
+    }
+
+    void clear() {
+        for (EntryMap::iterator it = entries.begin(); it != entries.end(); ++it)
+            delete it->second.tokens;
+        entries.clear();
+    }
+
+    /** key of the invocation at tok, false if it is too long or not a complete invocation */
+    static bool makeKey(const simplecpp::Macro &macro, const simplecpp::Token *tok, std::string &key) {
+        key = tok->str();
+        key += tok->whitespaceahead ? '\1' : '\0';
+        if (!macro.functionLike())
+            return true;
+        const simplecpp::Token *rawtok = tok->next;
+        if (!rawtok || rawtok->op != '(')
+            return false;
+        int par = 0;
+        for (unsigned int n = 0; n < MAX_KEY_TOKENS; ++n, rawtok = rawtok->next) {
+            if (!rawtok || (rawtok->op == '#' && !sameline(rawtok->previous, rawtok)))
+                return false;
+            key += rawtok->str();
+            key += rawtok->whitespaceahead ? '\1' : '\0';
+            if (rawtok->op == '(')
+                ++par;
+            else if (rawtok->op == ')' && --par == 0)
+                return true;
+        }
+        return false;
+    }
+
+    /** expand a cached invocation, false if it is not cached */
+    bool expand(simplecpp::TokenList &output, const simplecpp::Token **tok1, const std::string &key) const {
+        const EntryMap::const_iterator it = entries.find(key);
+        if (it == entries.end())
+            return false;
+        const simplecpp::Token *tok = *tok1;
+        for (const simplecpp::Token *valuetok = it->second.tokens->cfront(); valuetok; valuetok = valuetok->next) {
+            simplecpp::Token * const newtok = new simplecpp::Token(*valuetok);
+            newtok->location = tok->location;
+            output.push_back(newtok);
+        }
+        for (unsigned int n = 0; n < it->second.length; ++n)
+            tok = tok->next;
+        *tok1 = tok;
+        return true;
+    }
+
+    /** remember the expansion of the invocation at tok that ended before next, if it can be reused */
+    void insert(const std::string &key, const simplecpp::Macro &macro, const simplecpp::MacroMap &macros, const simplecpp::Token *tok, const simplecpp::Token *next, const simplecpp::TokenList &value) {
+        unsigned int length = 1;
+        for (const simplecpp::Token *rawtok = tok->next; rawtok != next; rawtok = rawtok->next, ++length) {
+            if (!rawtok || length > MAX_KEY_TOKENS)
+                return;
+        }
+        for (const simplecpp::Token *valuetok = value.cfront(); valuetok; valuetok = valuetok->next) {
+            if (valuetok->location.fileIndex != tok->location.fileIndex || valuetok->location.line != tok->location.line || valuetok->location.col != tok->location.col)
+                return;
+        }
+        if (!rescanStops(macro, macros, value))
+            return;
+        Entry &entry = entries[key];
+        if (!entry.tokens)
+            entry.tokens = new simplecpp::TokenList(files);
+        entry.tokens->clear();
+        for (const simplecpp::Token *valuetok = value.cfront(); valuetok; valuetok = valuetok->next)
+            entry.tokens->push_back(new simplecpp::Token(*valuetok));
+        entry.length = length;
+    }
+
+    /** number of expansions of the builtin macros that change with the invocation */
+    static std::size_t builtinUsage(const simplecpp::MacroMap &macros) {
+        static const char * const builtins[] = { "__COUNTER__", "__FILE__", "__LINE__" };
+        std::size_t usage = 0;
+        for (std::size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+            const simplecpp::MacroMap::const_iterator it = macros.find(builtins[i]);
+            if (it != macros.end())
+                usage += it->second.usage().size();
+        }
+        return usage;
+    }
+
+private:
+    /** mirrors the rescan loop at the end of Macro::expand(): does it stop before looking at the following tokens */
+    static bool rescanStops(const simplecpp::Macro &macro, const simplecpp::MacroMap &macros, const simplecpp::TokenList &value) {
+        unsigned int par = 0;
+        const simplecpp::Token *macro2tok = value.cback();
+        while (macro2tok) {
+            if (macro2tok->op == '(') {
+                if (par == 0)
+                    break;
+                --par;
+            } else if (macro2tok->op == ')')
+                ++par;
+            macro2tok = macro2tok->previous;
+        }
+        macro2tok = macro2tok ? macro2tok->previous : value.cback();
+        if (!macro2tok || !macro2tok->name)
+            return true;
+        if (value.cfront() != value.cback() && macro2tok->str() == macro.name())
+            return true;
+        const simplecpp::MacroMap::const_iterator it = macros.find(macro2tok->str());
+        return it == macros.end() || !it->second.functionLike();
+    }
+
+    enum { MAX_KEY_TOKENS = 256 };
+
+    struct Entry {
+        Entry() : tokens(nullptr), length(0) {}
+        simplecpp::TokenList *tokens;
+        unsigned int length;
+    };
+#if __cplusplus >= 201103L
+    typedef std::unordered_map<std::string, Entry> EntryMap;
+#else
+    typedef std::map<std::string, Entry> EntryMap;
+#endif
+
+    std::vector<std::string> &files;
+    EntryMap entries;
+};
+
+/**
+ * Results of #if and #elif conditions already evaluated by preprocess(), keyed by the text of the condition.
+ * Conditions using __has_include or an expansion of __COUNTER__, __FILE__ or __LINE__ are not stored.
+ * Every #define and #undef clears the cache.
+ */
+class ConditionCache {
+public:
+    /** key of the condition of the directive at tok, false if it is not cached */
+    bool find(const simplecpp::Token *directive, std::string &key, bool &value) const {
+        key.clear();
+        for (const simplecpp::Token *tok = directive->next; tok && tok->location.sameline(directive->location); tok = tok->next) {
+            if (tok->str() == HAS_INCLUDE) {
+                key.clear();
+                return false;
+            }
+            key += tok->str();
+            key += '\0';
+        }
+        const ResultMap::const_iterator it = results.find(key);
+        if (it == results.end())
+            return false;
+        value = it->second;
+        return true;
+    }
+
+    void insert(const std::string &key, bool value) {
+        if (!key.empty())
+            results[key] = value;
+    }
+
+    void clear() {
+        results.clear();
+    }
+
+private:
+#if __cplusplus >= 201103L
+    typedef std::unordered_map<std::string, bool> ResultMap;
+#else
+    typedef std::map<std::string, bool> ResultMap;
+#endif
+    ResultMap results;
+};
+
+static bool preprocessToken(simplecpp::TokenList &output, const simplecpp::Token **tok1, simplecpp::MacroMap &macros, std::vector<std::string> &files, simplecpp::OutputList *outputList, ExpansionCache *expansionCache)
 {
     const simplecpp::Token * const tok = *tok1;
     const simplecpp::MacroMap::const_iterator it = macros.find(tok->str());
     if (it != macros.end()) {
+        std::string key;
+        const bool cacheable = expansionCache && ExpansionCache::makeKey(it->second, tok, key);
+        if (cacheable && expansionCache->expand(output, tok1, key))
+            return true;
+        const std::size_t builtinUsage = cacheable ? ExpansionCache::builtinUsage(macros) : 0;
         simplecpp::TokenList value(files);
         try {
             *tok1 = it->second.expand(&value, tok, macros, files);
+            if (cacheable && ExpansionCache::builtinUsage(macros) == builtinUsage)
+                expansionCache->insert(key, it->second, macros, tok, *tok1, value);
         } catch (simplecpp::Macro::Error &err) {
             if (outputList) {
                 simplecpp::Output out(files);
@@ -3316,10 +4642,7 @@ static std::string getTimeDefine(const struct tm *timep)
 
 void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenList &rawtokens, std::vector<std::string> &files, std::map<std::string, simplecpp::TokenList *> &filedata, const simplecpp::DUI &dui, simplecpp::OutputList *outputList, std::list<simplecpp::MacroUsage> *macroUsage, std::list<simplecpp::IfCond> *ifCond)
 {
-#ifdef SIMPLECPP_WINDOWS
-    if (dui.clearIncludeCache)
-        nonExistingFilesCache.clear();
-#endif
+    headerLookupCache().prepare(dui);
 
     std::map<std::string, std::size_t> sizeOfType(rawtokens.sizeOfType);
     sizeOfType.insert(std::make_pair("char", sizeof(char)));
@@ -3413,10 +4736,44 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
 
     std::map<std::string, std::list<Location> > maybeUsedMacros;
 
-    for (const Token *rawtok = nullptr; rawtok || !includetokenstack.empty();) {
+    // conditional blocks tokenized on demand, see DUI::lazyConditionals
+    std::list<TokenList> rawBlocks;
+    // where to continue after each entered raw block, with the include depth it was entered at.
+    // kept apart from includetokenstack so conditional nesting does not count toward the include limit
+    std::stack<std::pair<const Token *, std::size_t> > rawBlockstack;
+
+    // cached invocations are not recorded in Macro::usage(), so the cache is off when that is reported
+    ExpansionCache expansionCacheStorage(files);
+    ExpansionCache * const expansionCache = macroUsage ? nullptr : &expansionCacheStorage;
+    // likewise for conditions, and every evaluation is reported to ifCond
+    ConditionCache conditionCacheStorage;
+    ConditionCache * const conditionCache = (macroUsage || ifCond) ? nullptr : &conditionCacheStorage;
+    std::string conditionKey;
+
+    for (const Token *rawtok = nullptr; rawtok || !includetokenstack.empty() || !rawBlockstack.empty();) {
         if (rawtok == nullptr) {
-            rawtok = includetokenstack.top();
-            includetokenstack.pop();
+            if (!rawBlockstack.empty() && rawBlockstack.top().second == includetokenstack.size()) {
+                rawtok = rawBlockstack.top().first;
+                rawBlockstack.pop();
+            } else {
+                rawtok = includetokenstack.top();
+                includetokenstack.pop();
+            }
+            continue;
+        }
+
+        if (rawtok->rawBlock) {
+            if (ifstates.top() != True) {
+                rawtok = rawtok->next;
+                continue;
+            }
+            rawBlocks.push_back(TokenList(files));
+            TokenList &block = rawBlocks.back();
+            block.readRawBlock(rawtok, outputList);
+            if (dui.removeComments)
+                block.removeComments();
+            rawBlockstack.push(std::make_pair(rawtok->next, includetokenstack.size()));
+            rawtok = block.cfront();
             continue;
         }
 
@@ -3473,6 +4830,10 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                             macros.insert(std::pair<TokenString, Macro>(macro.name(), macro));
                         else
                             it->second = macro;
+                        if (expansionCache)
+                            expansionCache->clear();
+                        if (conditionCache)
+                            conditionCache->clear();
                     }
                 } catch (const std::runtime_error &) {
                     if (outputList) {
@@ -3494,7 +4855,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                 TokenList inc2(files);
                 if (!inc1.empty() && inc1.cfront()->name) {
                     const Token *inctok = inc1.cfront();
-                    if (!preprocessToken(inc2, &inctok, macros, files, outputList)) {
+                    if (!preprocessToken(inc2, &inctok, macros, files, outputList, expansionCache)) {
                         output.clear();
                         return;
                     }
@@ -3533,14 +4894,9 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                 std::string header2 = getFileName(filedata, rawtok->location.file(), header, dui, systemheader);
                 if (header2.empty()) {
                     // try to load file..
-                    std::ifstream f;
-                    header2 = openHeader(f, dui, rawtok->location.file(), header, systemheader);
-                    if (f.is_open()) {
-                        f.close();
-                        TokenList * const tokens = new TokenList(header2, files, outputList);
-                        if (dui.removeComments)
-                            tokens->removeComments();
-                        filedata[header2] = tokens;
+                    header2 = openHeader(dui, rawtok->location.file(), header, systemheader);
+                    if (!header2.empty()) {
+                        filedata[header2] = readHeader(header2, files, dui, outputList);
                     }
                 }
                 if (header2.empty()) {
@@ -3587,7 +4943,10 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                 } else if (rawtok->str() == IFNDEF) {
                     conditionIsTrue = (macros.find(rawtok->next->str()) == macros.end() && !(hasInclude && rawtok->next->str() == HAS_INCLUDE));
                     maybeUsedMacros[rawtok->next->str()].push_back(rawtok->next->location);
+                } else if (conditionCache && conditionCache->find(rawtok, conditionKey, conditionIsTrue)) {
+                    // evaluated before with the same macro definitions
                 } else { /*if (rawtok->str() == IF || rawtok->str() == ELIF)*/
+                    const std::size_t builtinUsage = conditionCache ? ExpansionCache::builtinUsage(macros) : 0;
                     TokenList expr(files);
                     for (const Token *tok = rawtok->next; tok && tok->location.sameline(rawtok->location); tok = tok->next) {
                         if (!tok->name) {
@@ -3647,8 +5006,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                                     header = realFilename(tok->str().substr(1U, tok->str().size() - 2U));
                                     closingAngularBracket = true;
                                 }
-                                std::ifstream f;
-                                const std::string header2 = openHeader(f,dui,sourcefile,header,systemheader);
+                                const std::string header2 = openHeader(dui,sourcefile,header,systemheader);
                                 expr.push_back(new Token(header2.empty() ? "0" : "1", tok->location));
                             }
                             if (par)
@@ -3670,7 +5028,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                         maybeUsedMacros[rawtok->next->str()].push_back(rawtok->next->location);
 
                         const Token *tmp = tok;
-                        if (!preprocessToken(expr, &tmp, macros, files, outputList)) {
+                        if (!preprocessToken(expr, &tmp, macros, files, outputList, expansionCache)) {
                             output.clear();
                             return;
                         }
@@ -3683,12 +5041,14 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                             std::string E;
                             for (const simplecpp::Token *tok = expr.cfront(); tok; tok = tok->next)
                                 E += (E.empty() ? "" : " ") + tok->str();
-                            const long long result = evaluate(expr, dui, sizeOfType);
+                            const long long result = evaluateCondition(expr, dui, sizeOfType);
                             conditionIsTrue = (result != 0);
                             ifCond->push_back(IfCond(rawtok->location, E, result));
                         } else {
-                            const long long result = evaluate(expr, dui, sizeOfType);
+                            const long long result = evaluateCondition(expr, dui, sizeOfType);
                             conditionIsTrue = (result != 0);
+                            if (conditionCache && ExpansionCache::builtinUsage(macros) == builtinUsage)
+                                conditionCache->insert(conditionKey, conditionIsTrue);
                         }
                     } catch (const std::exception &e) {
                         if (outputList) {
@@ -3725,8 +5085,12 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                     const Token *tok = rawtok->next;
                     while (sameline(rawtok,tok) && tok->comment)
                         tok = tok->next;
-                    if (sameline(rawtok, tok))
-                        macros.erase(tok->str());
+                    if (sameline(rawtok, tok) && macros.erase(tok->str())) {
+                        if (expansionCache)
+                            expansionCache->clear();
+                        if (conditionCache)
+                            conditionCache->clear();
+                    }
                 }
             } else if (ifstates.top() == True && rawtok->str() == PRAGMA && rawtok->next && rawtok->next->str() == ONCE && sameline(rawtok,rawtok->next)) {
                 pragmaOnce.insert(rawtok->location.file());
@@ -3755,7 +5119,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
         const Location loc(rawtok->location);
         TokenList tokens(files);
 
-        if (!preprocessToken(tokens, &rawtok, macros, files, outputList)) {
+        if (!preprocessToken(tokens, &rawtok, macros, files, outputList, expansionCache)) {
             output.clear();
             return;
         }
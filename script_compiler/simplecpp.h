@@ -100,12 +100,12 @@ namespace simplecpp {
     class SIMPLECPP_LIB Token {
     public:
         Token(const TokenString &s, const Location &loc, bool wsahead = false) :
-            whitespaceahead(wsahead), location(loc), previous(nullptr), next(nullptr), string(s) {
+            rawBlock(false), whitespaceahead(wsahead), location(loc), previous(nullptr), next(nullptr), string(s) {
             flags();
         }
 
         Token(const Token &tok) :
-            macro(tok.macro), op(tok.op), comment(tok.comment), name(tok.name), number(tok.number), whitespaceahead(tok.whitespaceahead), location(tok.location), previous(nullptr), next(nullptr), string(tok.string), mExpandedFrom(tok.mExpandedFrom) {
+            macro(tok.macro), op(tok.op), comment(tok.comment), name(tok.name), number(tok.number), rawBlock(tok.rawBlock), whitespaceahead(tok.whitespaceahead), location(tok.location), previous(nullptr), next(nullptr), string(tok.string), mExpandedFrom(tok.mExpandedFrom) {
         }
 
         void flags() {
@@ -137,6 +137,8 @@ namespace simplecpp {
         bool comment;
         bool name;
         bool number;
+        /** unlexed body of a conditional block, str() is its source text (see DUI::lazyConditionals) */
+        bool rawBlock;
         bool whitespaceahead;
         Location location;
         Token *previous;
@@ -199,6 +201,13 @@ namespace simplecpp {
 
     typedef std::list<Output> OutputList;
 
+    /** Receives the text produced by TokenList::stringify() piece by piece */
+    class SIMPLECPP_LIB OutputSink {
+    public:
+        virtual ~OutputSink() {}
+        virtual void write(const char *data, std::size_t size) = 0;
+    };
+
     /** List of tokens. */
     class SIMPLECPP_LIB TokenList {
     public:
@@ -208,11 +217,14 @@ namespace simplecpp {
         /** generates a token list from the given std::istream parameter */
         TokenList(std::istream &istr, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr);
         /** generates a token list from the given buffer */
-        TokenList(const unsigned char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr);
+        TokenList(const unsigned char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr, bool lazyConditionals = false);
         /** generates a token list from the given buffer */
-        TokenList(const char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr);
-        /** generates a token list from the given filename parameter */
-        TokenList(const std::string &filename, std::vector<std::string> &filenames, OutputList *outputList = nullptr);
+        TokenList(const char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr, bool lazyConditionals = false);
+        /**
+         * generates a token list from the given filename parameter
+         * @param lazyConditionals keep the bodies of #if/#elif/#else blocks as raw text tokens, see readRawBlock()
+         */
+        TokenList(const std::string &filename, std::vector<std::string> &filenames, OutputList *outputList = nullptr, bool lazyConditionals = false);
         TokenList(const TokenList &other);
 #if __cplusplus >= 201103L
         TokenList(TokenList &&other);
@@ -231,8 +243,20 @@ namespace simplecpp {
 
         void dump() const;
         std::string stringify() const;
+        /** writes the same text as stringify() to sink without building it in memory */
+        void stringify(OutputSink &sink) const;
 
         void readfile(Stream &stream, const std::string &filename=std::string(), OutputList *outputList = nullptr);
+        /** tokenizes the source text of a rawBlock token, nested conditional blocks are kept raw again */
+        void readRawBlock(const Token *block, OutputList *outputList = nullptr);
+
+        /** appends a compact binary image of the tokens (interned strings, file names, locations) to data */
+        void serialize(std::string &data) const;
+        /**
+         * replaces the tokens with an image written by serialize(), its file names are added to the file list
+         * @return false if the image is malformed, the list is empty then
+         */
+        bool deserialize(const char *data, std::size_t size);
         void constFold();
 
         void removeComments();
@@ -266,6 +290,7 @@ namespace simplecpp {
                 frontToken = next;
             if (backToken == tok)
                 backToken = prev;
+            lastLineSize = -1;
             delete tok;
         }
 
@@ -280,6 +305,9 @@ namespace simplecpp {
             }
             backToken = other.backToken;
             other.frontToken = other.backToken = nullptr;
+            lastLineSize = -1;
+            other.lastLineStart = nullptr;
+            other.lastLineSize = 0;
         }
 
         /** sizeof(T) */
@@ -301,6 +329,8 @@ namespace simplecpp {
         void constFoldLogicalOp(Token *tok);
         void constFoldQuestionOp(Token **tok1);
 
+        void readStream(Stream &stream, Location location, OutputList *outputList);
+        bool readConditionalBlock(Stream &stream, Location *location);
         std::string readUntil(Stream &stream, const Location &location, char start, char end, OutputList *outputList);
         void lineDirective(unsigned int fileIndex, unsigned int line, Location *location);
 
@@ -313,6 +343,10 @@ namespace simplecpp {
         Token *frontToken;
         Token *backToken;
         std::vector<std::string> &files;
+        bool lazyConditionals;
+        /** first non-comment token on the line of backToken and the number of non-comment tokens there, kept by push_back(); -1 if lastLineTok() must count again */
+        mutable const Token *lastLineStart;
+        mutable int lastLineSize;
     };
 
     /** Tracking how macros are used */
@@ -332,12 +366,34 @@ namespace simplecpp {
         long long result; // condition result
     };
 
+    struct DUI;
+
+    /** Hook for reading headers, e.g. from a token cache */
+    class SIMPLECPP_LIB HeaderLoader {
+    public:
+        virtual ~HeaderLoader() {}
+        /**
+         * Tokenize a header
+         * @param path path of the header, it is known to exist
+         * @return new token list owned by the caller, or nullptr to let simplecpp read the file
+         */
+        virtual TokenList *load(const std::string &path, std::vector<std::string> &filenames, const DUI &dui, OutputList *outputList) = 0;
+        /**
+         * Called by simplecpp::load() as soon as an include is found, before the header is
+         * needed. Loaders may start reading and lexing it in the background.
+         */
+        virtual void prefetch(const std::string &path, const DUI &dui) {
+            (void)path;
+            (void)dui;
+        }
+    };
+
     /**
      * Command line preprocessor settings.
      * On the command line these are configured by -D, -U, -I, --include, -std
      */
     struct SIMPLECPP_LIB DUI {
-        DUI() : clearIncludeCache(false), removeComments(false) {}
+        DUI() : clearIncludeCache(false), removeComments(false), lazyConditionals(false), headerLoader(nullptr) {}
         std::list<std::string> defines;
         std::set<std::string> undefined;
         std::list<std::string> includePaths;
@@ -345,6 +401,8 @@ namespace simplecpp {
         std::string std;
         bool clearIncludeCache;
         bool removeComments; /** remove comment tokens from included files */
+        bool lazyConditionals; /** lex the bodies of #if/#elif/#else blocks only when they become active */
+        HeaderLoader *headerLoader; /** reads headers and -include files, optional */
     };
 
     SIMPLECPP_LIB long long characterLiteralToLL(const std::string& str);
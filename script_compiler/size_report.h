@@ -0,0 +1,190 @@
+#pragma once
+#include <luisa/core/logging.h>
+#include <luisa/core/stl/filesystem.h>
+#include <luisa/core/stl/optional.h>
+#include <luisa/core/stl/string.h>
+#include <luisa/core/stl/unordered_map.h>
+#include <luisa/core/stl/vector.h>
+#include <luisa/core/stl/pdqsort.h>
+#include <luisa/vstl/spin_mutex.h>
+#include "function_dedup.h"
+#include "utils.h"
+
+// Code size report of the generated C, written by --report=size.
+// Lists every function definition of every generated file with its token and source byte count, the machine code
+// bytes from the object file next to it (ELF objects of --cc builds only) and the script or header line it was
+// generated from if the file has #line markers (--profile). The same function is also summed over all files,
+// so templates instantiated by many scripts stand out.
+class SizeReport {
+	struct Entry {
+		luisa::string file;
+		FunctionDedup::FunctionInfo info;
+		// null without an object, 0 if the function was inlined into all of its callers or never used
+		luisa::optional<size_t> code_bytes;
+	};
+	struct Aggregate {
+		luisa::string origin;
+		size_t files{};
+		size_t tokens{};
+		size_t bytes{};
+		luisa::optional<size_t> code_bytes;
+	};
+	vstd::spin_mutex _mtx;
+	luisa::vector<Entry> _entries;
+
+	template<typename T>
+	static T load(luisa::string const& data, size_t offset) {
+		T value{};
+		if (offset + sizeof(T) <= data.size()) {
+			std::memcpy(&value, data.data() + offset, sizeof(T));
+		}
+		return value;
+	}
+	// sizes of the function symbols of a 64 bit little endian ELF object, empty for anything else
+	// clones of target_clones (name.avx2.0, name.default.1, name.resolver) are added to name
+	static luisa::unordered_map<luisa::string, size_t> function_sizes(std::filesystem::path const& obj_path) {
+		luisa::unordered_map<luisa::string, size_t> sizes;
+		luisa::string data;
+		// ELFCLASS64, ELFDATA2LSB
+		if (!read_file(obj_path, data) || data.size() < 64 || std::memcmp(data.data(), "\177ELF", 4) != 0 || data[4] != 2 || data[5] != 1) {
+			return sizes;
+		}
+		auto section_offset = load<uint64_t>(data, 0x28);
+		auto section_size = load<uint16_t>(data, 0x3a);
+		auto section_count = load<uint16_t>(data, 0x3c);
+		for (size_t i = 0; i < section_count; ++i) {
+			auto section = section_offset + i * section_size;
+			// SHT_SYMTAB
+			if (load<uint32_t>(data, section + 4) != 2) continue;
+			auto symbol_offset = load<uint64_t>(data, section + 0x18);
+			auto symbol_bytes = load<uint64_t>(data, section + 0x20);
+			auto symbol_size = load<uint64_t>(data, section + 0x38);
+			auto string_section = section_offset + load<uint32_t>(data, section + 0x28) * section_size;
+			auto string_offset = load<uint64_t>(data, string_section + 0x18);
+			if (symbol_size == 0 || symbol_offset + symbol_bytes > data.size()) continue;
+			for (size_t sym = symbol_offset; sym + symbol_size <= symbol_offset + symbol_bytes; sym += symbol_size) {
+				// STT_FUNC
+				if ((load<uint8_t>(data, sym + 4) & 0xf) != 2) continue;
+				auto name_offset = string_offset + load<uint32_t>(data, sym);
+				if (name_offset >= data.size()) continue;
+				luisa::string_view name{data.data() + name_offset};
+				name = name.substr(0, std::min(name.find('.'), name.size()));
+				sizes[luisa::string{name}] += load<uint64_t>(data, sym + 0x10);
+			}
+		}
+		return sizes;
+	}
+	// dedup renames shared functions to name_s<16 hex digits>
+	static luisa::string_view base_name(luisa::string_view name) {
+		if (name.size() > 18 && name[name.size() - 18] == '_' && name[name.size() - 17] == 's' &&
+			name.substr(name.size() - 16).find_first_not_of("0123456789abcdef") == luisa::string_view::npos) {
+			return name.substr(0, name.size() - 18);
+		}
+		return name;
+	}
+	static luisa::string json_size(luisa::optional<size_t> const& value) {
+		return value ? luisa::format("{}", *value) : luisa::string{"null"};
+	}
+	// largest first, by machine code if known, then by source
+	template<typename T>
+	static bool larger(T const& a_code, size_t a_bytes, T const& b_code, size_t b_bytes) {
+		auto a = a_code.value_or(0);
+		auto b = b_code.value_or(0);
+		if (a != b) return a > b;
+		return a_bytes > b_bytes;
+	}
+
+public:
+	// file is the name written into the report, obj_path may not exist
+	void add(luisa::string file, std::filesystem::path const& c_path, std::filesystem::path const& obj_path) {
+		auto functions = FunctionDedup::scan(c_path);
+		std::error_code ec;
+		bool has_object = std::filesystem::exists(obj_path, ec);
+		auto sizes = has_object ? function_sizes(obj_path) : luisa::unordered_map<luisa::string, size_t>{};
+		has_object &= !sizes.empty();
+		std::lock_guard lck{_mtx};
+		for (auto& info : functions) {
+			auto& entry = _entries.emplace_back();
+			entry.file = file;
+			if (has_object) {
+				auto iter = sizes.find(info.name);
+				entry.code_bytes = iter == sizes.end() ? 0 : iter->second;
+			}
+			entry.info = std::move(info);
+		}
+	}
+	bool write(std::filesystem::path const& path) {
+		pdqsort(_entries.begin(), _entries.end(), [](Entry const& a, Entry const& b) {
+			if (larger(a.code_bytes, a.info.bytes, b.code_bytes, b.info.bytes)) return true;
+			if (larger(b.code_bytes, b.info.bytes, a.code_bytes, a.info.bytes)) return false;
+			if (a.file != b.file) return a.file < b.file;
+			return a.info.name < b.info.name;
+		});
+		luisa::unordered_map<luisa::string, Aggregate> aggregates;
+		for (auto& entry : _entries) {
+			auto& aggregate = aggregates[luisa::string{base_name(entry.info.name)}];
+			if (aggregate.origin.empty()) {
+				aggregate.origin = entry.info.origin;
+			}
+			++aggregate.files;
+			aggregate.tokens += entry.info.tokens;
+			aggregate.bytes += entry.info.bytes;
+			if (entry.code_bytes) {
+				aggregate.code_bytes = aggregate.code_bytes.value_or(0) + *entry.code_bytes;
+			}
+		}
+		luisa::vector<std::pair<luisa::string, Aggregate>> sorted_aggregates{aggregates.begin(), aggregates.end()};
+		pdqsort(sorted_aggregates.begin(), sorted_aggregates.end(), [](auto const& a, auto const& b) {
+			if (larger(a.second.code_bytes, a.second.bytes, b.second.code_bytes, b.second.bytes)) return true;
+			if (larger(b.second.code_bytes, b.second.bytes, a.second.code_bytes, a.second.bytes)) return false;
+			return a.first < b.first;
+		});
+		luisa::string r = "{\n  \"version\": 1,\n  \"functions\": [";
+		bool comma = false;
+		for (auto& entry : _entries) {
+			r += comma ? ",\n    " : "\n    ";
+			comma = true;
+			r += luisa::format(
+				"{{\"file\": {}, \"function\": {}, \"origin\": {}, \"static\": {}, \"tokens\": {}, \"source_bytes\": {}, \"code_bytes\": {}}}",
+				json_string(entry.file),
+				json_string(entry.info.name),
+				json_string(entry.info.origin),
+				entry.info.is_static,
+				entry.info.tokens,
+				entry.info.bytes,
+				json_size(entry.code_bytes));
+		}
+		r += "\n  ],\n  \"aggregate\": [";
+		comma = false;
+		for (auto& [name, aggregate] : sorted_aggregates) {
+			r += comma ? ",\n    " : "\n    ";
+			comma = true;
+			r += luisa::format(
+				"{{\"function\": {}, \"origin\": {}, \"files\": {}, \"tokens\": {}, \"source_bytes\": {}, \"code_bytes\": {}}}",
+				json_string(name),
+				json_string(aggregate.origin),
+				aggregate.files,
+				aggregate.tokens,
+				aggregate.bytes,
+				json_size(aggregate.code_bytes));
+		}
+		r += "\n  ]\n}\n";
+		auto path_str = luisa::to_string(path);
+		auto f = fopen(path_str.c_str(), "wb");
+		if (!f) [[unlikely]] {
+			LUISA_WARNING("Write size report '{}' failed.", path_str);
+			return false;
+		}
+		bool success = fwrite(r.data(), 1, r.size(), f) == r.size();
+		success &= fclose(f) == 0;
+		if (!success) [[unlikely]] {
+			LUISA_WARNING("Write size report '{}' failed.", path_str);
+			return false;
+		}
+		for (size_t i = 0; i < std::min<size_t>(sorted_aggregates.size(), 10); ++i) {
+			auto& [name, aggregate] = sorted_aggregates[i];
+			LUISA_INFO("{} x{}: {} tokens, {} source bytes, {} code bytes{}{}", name, aggregate.files, aggregate.tokens, aggregate.bytes, json_size(aggregate.code_bytes), aggregate.origin.empty() ? "" : ", from ", aggregate.origin);
+		}
+		return true;
+	}
+};
@@ -0,0 +1,65 @@
+#include <luisa/core/fiber.h>
+#include <luisa/core/logging.h>
+#include "function_dedup.h"
+
+// Runs FunctionDedup::run on small C files in a temporary directory and checks which static functions are shared
+// (--dedup) and which are dropped as unreachable (--gc).
+// Usage: test_function_dedup
+
+static void write_text(std::filesystem::path const& path, luisa::string_view text) {
+	auto f = fopen(luisa::to_string(path).c_str(), "wb");
+	if (!f) [[unlikely]] {
+		LUISA_ERROR("Write {} failed.", luisa::to_string(path));
+	}
+	fwrite(text.data(), text.size(), 1, f);
+	fclose(f);
+}
+
+int main() {
+	luisa::fiber::scheduler thread_pool;
+	auto dir = std::filesystem::temp_directory_path() / "test_function_dedup";
+	std::error_code ec;
+	std::filesystem::remove_all(dir, ec);
+	std::filesystem::create_directories(dir);
+	// the same helper in two files, shared
+	write_text(dir / "same_a.c", "static int helper(int a, int b) { return a * b + 1; }\nint same_a(int x) { return helper(x, 2); }\n");
+	write_text(dir / "same_b.c", "static int helper(int a, int b) { return a * b + 1; }\nint same_b(int x) { return helper(x, 3); }\n");
+	// a+ ++b and a++ +b only differ in how the pluses are grouped into tokens, not shared
+	write_text(dir / "plus_a.c", "static int plus(int a, int b) { return a+ ++b; }\nint plus_a(int x) { return plus(x, 2); }\n");
+	write_text(dir / "plus_b.c", "static int plus(int a, int b) { return a++ +b; }\nint plus_b(int x) { return plus(x, 2); }\n");
+	// nothing calls these, only the attributed ones stay
+	write_text(dir / "roots.c",
+			   "static void unused(void) {}\n"
+			   "static void init(void) __attribute__((constructor));\n"
+			   "static void init(void) {}\n"
+			   "__attribute__((destructor)) static void fini(void) {}\n"
+			   "static void keep(void) __attribute__((used));\n"
+			   "static void keep(void) {}\n"
+			   "int roots(void) { return 0; }\n");
+	FunctionDedup dedup;
+	for (auto name : {"same_a.c", "same_b.c", "plus_a.c", "plus_b.c", "roots.c"}) {
+		dedup.add(dir / name);
+	}
+	dedup.run(dir, FunctionDedup::Settings{.option_key = "test", .strip_dead = true});
+	auto expect = [&](char const* name, luisa::string_view text, bool contained) {
+		luisa::string data;
+		if (!read_file(dir / name, data)) [[unlikely]] {
+			LUISA_ERROR("Read {} failed.", name);
+		}
+		if ((data.find(text) != luisa::string::npos) != contained) {
+			LUISA_ERROR("{} {} '{}':\n{}", name, contained ? "does not contain" : "contains", text, data);
+		}
+	};
+	expect("same_a.dedup.c", "static int helper", false);
+	expect("same_b.dedup.c", "static int helper", false);
+	expect("common_0.c", "return a * b + 1;", true);
+	expect("plus_a.dedup.c", "static int plus(int a, int b) { return a+ ++b; }", true);
+	expect("plus_b.dedup.c", "static int plus(int a, int b) { return a++ +b; }", true);
+	expect("common_0.c", "plus", false);
+	expect("roots.dedup.c", "unused", false);
+	expect("roots.dedup.c", "static void init(void) {}", true);
+	expect("roots.dedup.c", "static void fini(void) {}", true);
+	expect("roots.dedup.c", "static void keep(void) {}", true);
+	LUISA_INFO("test_function_dedup passed.");
+	return 0;
+}
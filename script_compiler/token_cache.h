@@ -0,0 +1,261 @@
+#pragma once
+#include <luisa/core/fiber.h>
+#include <luisa/core/logging.h>
+#include <luisa/core/stl/filesystem.h>
+#include <luisa/core/stl/hash.h>
+#include <luisa/core/stl/unordered_map.h>
+#include <luisa/core/stl/memory.h>
+#include <luisa/vstl/spin_mutex.h>
+#include <luisa/vstl/v_guid.h>
+#include "simplecpp.h"
+#include "utils.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only mapping of a whole file, invalid if the file can not be opened or is empty.
+class MappedFile {
+	void const* _data{};
+	size_t _size{};
+#ifdef _WIN32
+	HANDLE _file{INVALID_HANDLE_VALUE};
+	HANDLE _mapping{};
+#endif
+
+public:
+	explicit MappedFile(std::filesystem::path const& path) {
+#ifdef _WIN32
+		_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (_file == INVALID_HANDLE_VALUE) return;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(_file, &size) || size.QuadPart == 0) return;
+		_mapping = CreateFileMappingW(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!_mapping) return;
+		_data = MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+		if (_data) {
+			_size = static_cast<size_t>(size.QuadPart);
+		}
+#else
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			auto ptr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (ptr != MAP_FAILED) {
+				_data = ptr;
+				_size = static_cast<size_t>(st.st_size);
+			}
+		}
+		// the mapping stays valid after the descriptor is closed
+		close(fd);
+#endif
+	}
+	MappedFile(MappedFile const&) = delete;
+	MappedFile& operator=(MappedFile const&) = delete;
+	~MappedFile() {
+#ifdef _WIN32
+		if (_data) UnmapViewOfFile(_data);
+		if (_mapping) CloseHandle(_mapping);
+		if (_file != INVALID_HANDLE_VALUE) CloseHandle(_file);
+#else
+		if (_data) munmap(const_cast<void*>(_data), _size);
+#endif
+	}
+	[[nodiscard]] bool valid() const { return _data != nullptr; }
+	[[nodiscard]] luisa::span<const std::byte> data() const {
+		return {reinterpret_cast<std::byte const*>(_data), _size};
+	}
+};
+
+// Persistent cache of lexed headers.
+// Every header is stored in its own file under the cache directory, holding the header path, size, modification time
+// and content hash followed by simplecpp::TokenList::serialize() output. Later runs map the file and deserialize the
+// tokens from the mapping; the header is only read and hashed again if its size or modification time changed.
+// Entries whose header changed are lexed again and overwritten.
+// prefetch() builds the image on a fiber worker, so a header is usually ready by the time simplecpp asks for it.
+class TokenCache final : public simplecpp::HeaderLoader {
+	// bump the version whenever the simplecpp lexer or the serialize() format changes
+	static constexpr char entry_magic[8] = {'S', 'C', 'T', 'K', 'N', 'v', '2', '\0'};
+	static constexpr uint64_t content_seed = 0x2545f4914f6cdd1dull;
+	struct EntryHeader {
+		char magic[8];
+		uint64_t source_size;
+		int64_t source_time;
+		uint64_t source_hash;
+		uint32_t lazy_conditionals;
+		uint32_t path_size;
+	};
+	// image of one header, ready once the event is signaled
+	// empty if the header can not be read or reports diagnostics, load() then lexes it again to surface them
+	struct Slot {
+		luisa::fiber::event ready;
+		// a valid cache entry stays mapped while the cache lives, image points into it
+		luisa::unique_ptr<MappedFile> mapping;
+		// freshly lexed image, or a copy of an entry that is rewritten
+		std::string lexed;
+		luisa::span<const std::byte> image;
+	};
+	std::filesystem::path _dir;
+	vstd::spin_mutex _mtx;
+	// images lexed or validated during this run, headers do not change while compiling
+	luisa::unordered_map<luisa::string, luisa::shared_ptr<Slot>> _slots;
+
+	// lazy and eager lexing produce different tokens, each has its own entry
+	std::filesystem::path entry_path(std::string const& path, bool lazy_conditionals) const {
+		return _dir / luisa::format("{:016x}{}.tok", luisa::hash64(path.data(), path.size(), content_seed), lazy_conditionals ? ".lazy" : "");
+	}
+	static luisa::string slot_key(std::string const& path, bool lazy_conditionals) {
+		luisa::string key{path};
+		if (lazy_conditionals) {
+			key += "\n#lazy";
+		}
+		return key;
+	}
+	void write_entry(std::filesystem::path const& entry, EntryHeader const& header, std::string const& path, luisa::span<const std::byte> image) {
+		std::error_code ec;
+		// write a private file first, so concurrent readers never see a partial entry
+		auto tmp_path = entry;
+		tmp_path += luisa::format(".{}.tmp", vstd::Guid{true}.to_string(false));
+		auto tmp_path_str = luisa::to_string(tmp_path);
+		auto f = std::fopen(tmp_path_str.c_str(), "wb");
+		if (!f) [[unlikely]] {
+			LUISA_WARNING("Write token cache '{}' failed.", tmp_path_str);
+			return;
+		}
+		bool success = std::fwrite(&header, sizeof(header), 1, f) == 1 &&
+					   std::fwrite(path.data(), 1, path.size(), f) == path.size() &&
+					   std::fwrite(image.data(), 1, image.size(), f) == image.size();
+		success &= std::fclose(f) == 0;
+		if (success) {
+			// fails on Windows while another process still maps the entry, it is then written again by a later run
+			std::filesystem::rename(tmp_path, entry, ec);
+			if (ec) [[unlikely]] {
+				LUISA_WARNING("Replace token cache '{}' failed, message: {}", luisa::to_string(entry), ec.message());
+			}
+		} else [[unlikely]] {
+			LUISA_WARNING("Write token cache '{}' failed.", tmp_path_str);
+		}
+		if (!success || ec) [[unlikely]] {
+			std::filesystem::remove(tmp_path, ec);
+		}
+	}
+	void build_image(Slot& slot, std::string const& path, bool lazy_conditionals) {
+		std::error_code ec;
+		EntryHeader header{};
+		memcpy(header.magic, entry_magic, sizeof(entry_magic));
+		header.source_size = std::filesystem::file_size(path, ec);
+		if (ec) {
+			return;
+		}
+		header.source_time = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+		header.lazy_conditionals = lazy_conditionals ? 1 : 0;
+		header.path_size = static_cast<uint32_t>(path.size());
+		auto entry = entry_path(path, lazy_conditionals);
+		auto mapping = luisa::make_unique<MappedFile>(entry);
+		auto data = mapping->data();
+		EntryHeader cached{};
+		bool entry_valid = mapping->valid() && data.size() >= sizeof(EntryHeader) + path.size();
+		if (entry_valid) {
+			memcpy(&cached, data.data(), sizeof(EntryHeader));
+			entry_valid = memcmp(cached.magic, header.magic, sizeof(header.magic)) == 0 &&
+						  cached.lazy_conditionals == header.lazy_conditionals &&
+						  cached.path_size == header.path_size &&
+						  memcmp(data.data() + sizeof(EntryHeader), path.data(), path.size()) == 0;
+		}
+		if (entry_valid && cached.source_size == header.source_size && cached.source_time == header.source_time) {
+			slot.image = data.subspan(sizeof(EntryHeader) + path.size());
+			slot.mapping = std::move(mapping);
+			return;
+		}
+		// touched or changed header, only its content tells
+		std::string source;
+		if (!read_file(path, source)) {
+			return;
+		}
+		header.source_size = source.size();
+		header.source_hash = luisa::hash64(source.data(), source.size(), content_seed);
+		if (entry_valid && cached.source_size == header.source_size && cached.source_hash == header.source_hash) {
+			// same content, store the new time so the next run skips the hash again.
+			// the image is copied and the entry unmapped first, Windows can not replace a mapped file
+			auto image = data.subspan(sizeof(EntryHeader) + path.size());
+			slot.lexed.assign(reinterpret_cast<char const*>(image.data()), image.size());
+			mapping.reset();
+			slot.image = {reinterpret_cast<std::byte const*>(slot.lexed.data()), slot.lexed.size()};
+			write_entry(entry, header, path, slot.image);
+			return;
+		}
+		mapping.reset();
+		// stale or missing entry
+		std::vector<std::string> filenames;
+		simplecpp::OutputList output_list;
+		simplecpp::TokenList tokens(source.data(), source.size(), filenames, path, &output_list, lazy_conditionals);
+		if (!output_list.empty()) {
+			// keep diagnostics visible on every run
+			return;
+		}
+		tokens.serialize(slot.lexed);
+		slot.image = {reinterpret_cast<std::byte const*>(slot.lexed.data()), slot.lexed.size()};
+		write_entry(entry, header, path, slot.image);
+	}
+	luisa::shared_ptr<Slot> acquire(std::string const& path, bool lazy_conditionals, bool async) {
+		luisa::shared_ptr<Slot> slot;
+		{
+			std::lock_guard lck{_mtx};
+			auto iter = _slots.try_emplace(slot_key(path, lazy_conditionals));
+			if (!iter.second) {
+				return iter.first->second;
+			}
+			slot = luisa::make_shared<Slot>();
+			iter.first->second = slot;
+		}
+		auto build = [this, slot, path, lazy_conditionals]() {
+			build_image(*slot, path, lazy_conditionals);
+			slot->ready.signal();
+		};
+		if (async) {
+			luisa::fiber::schedule(std::move(build));
+		} else {
+			build();
+		}
+		return slot;
+	}
+
+public:
+	explicit TokenCache(std::filesystem::path&& dir) : _dir(std::move(dir)) {
+		if (!std::filesystem::exists(_dir)) {
+			std::error_code ec;
+			std::filesystem::create_directories(_dir, ec);
+			if (ec) [[unlikely]] {
+				LUISA_ERROR("Create token cache path '{}' failed, message: {}", luisa::to_string(_dir), ec.message());
+			}
+		}
+	}
+	~TokenCache() {
+		// speculative prefetches may still be running
+		for (auto&& i : _slots) {
+			i.second->ready.wait();
+		}
+	}
+	void prefetch(const std::string& path, const simplecpp::DUI& dui) override {
+		acquire(path, dui.lazyConditionals, true);
+	}
+	simplecpp::TokenList* load(const std::string& path, std::vector<std::string>& filenames, const simplecpp::DUI& dui, simplecpp::OutputList* outputList) override {
+		auto slot = acquire(path, dui.lazyConditionals, false);
+		slot->ready.wait();
+		if (slot->image.empty()) {
+			// let simplecpp lex it and report
+			return nullptr;
+		}
+		auto tokens = new simplecpp::TokenList(filenames);
+		if (!tokens->deserialize(reinterpret_cast<char const*>(slot->image.data()), slot->image.size())) [[unlikely]] {
+			delete tokens;
+			return nullptr;
+		}
+		return tokens;
+	}
+};
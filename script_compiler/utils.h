@@ -0,0 +1,57 @@
+#pragma once
+#include <luisa/core/stl/filesystem.h>
+#include <luisa/core/stl/string.h>
+#include <cstdio>
+
+// Helpers shared by script_compiler and simplecpp_bench.
+
+// Appends the whole file to data, false if it can not be opened.
+template<typename String>
+bool read_file(std::filesystem::path const& path, String& data) {
+	auto f = fopen(luisa::to_string(path).c_str(), "rb");
+	if (!f) return false;
+	char buffer[65536];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+		data.append(buffer, n);
+	}
+	fclose(f);
+	return true;
+}
+
+// Quoted JSON string of strv.
+inline luisa::string json_string(luisa::string_view strv) {
+	static constexpr char hex[] = "0123456789abcdef";
+	luisa::string r;
+	r.reserve(strv.size() + 2);
+	r += '"';
+	for (auto& i : strv) {
+		switch (i) {
+			case '"':
+			case '\\':
+				r += '\\';
+				r += i;
+				break;
+			case '\n':
+				r += "\\n";
+				break;
+			case '\r':
+				r += "\\r";
+				break;
+			case '\t':
+				r += "\\t";
+				break;
+			default:
+				if (static_cast<unsigned char>(i) < 0x20) {
+					r += "\\u00";
+					r += hex[i >> 4];
+					r += hex[i & 15];
+				} else {
+					r += i;
+				}
+				break;
+		}
+	}
+	r += '"';
+	return r;
+}
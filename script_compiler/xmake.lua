@@ -23,8 +23,47 @@ if lc_options.toy_c_backend then
         target_end()
     end
 
+    -- profile guided optimization of the generated C, needs clang:
+    --   xmake f --script_pgo=generate && xmake    instrumented build
+    --   xmake run test_scripts                    training run, writes raw profiles
+    --   xmake f --script_pgo=use && xmake         merges them and rebuilds with the profiles
+    option("script_pgo")
+    set_default("off")
+    set_values("off", "generate", "use")
+    set_showmenu(true)
+    set_description("Profile guided optimization of compiled scripts.")
+    option_end()
+
     rule('compile_clang_script')
     set_extensions('.lua')
+    on_load(function(target)
+        if get_config("script_pgo") == "generate" then
+            -- links the profile runtime
+            target:add("shflags", "-fprofile-instr-generate", {
+                force = true
+            })
+            target:add("ldflags", "-fprofile-instr-generate", {
+                force = true
+            })
+        end
+    end)
+    on_config(function(target)
+        if not target:extraconf("rules", "compile_clang_script", "gc") then
+            return
+        end
+        -- one section per function, so the linker drops what no kernel or export references
+        if target:has_tool("cc", "cl", "clang_cl") then
+            target:add("cflags", "/Gy")
+            target:add("shflags", "/OPT:REF")
+        else
+            target:add("cflags", "-ffunction-sections", "-fdata-sections")
+            if target:is_plat("macosx") then
+                target:add("shflags", "-Wl,-dead_strip")
+            else
+                target:add("shflags", "-Wl,--gc-sections")
+            end
+        end
+    end)
     on_clean(function(target)
         local out_dir = target:extraconf("rules", "compile_clang_script", "out_dir")
         out_dir = path.join(target:targetdir(), out_dir)
@@ -33,6 +72,8 @@ if lc_options.toy_c_backend then
         end
     end)
     before_buildcmd_file(function(target, batchcmds, sourcefile, opt)
+        import("core.base.json")
+        import("core.tool.compiler")
         local out_dir = target:extraconf("rules", "compile_clang_script", "out_dir")
         out_dir = path.join(path.absolute(target:targetdir()), out_dir)
         local mod = import(path.basename(sourcefile), {
@@ -42,27 +83,280 @@ if lc_options.toy_c_backend then
         if is_host("windows") then
             compiler = compiler .. ".exe";
         end
-        os.vrunv(compiler,
-            {'--in=' .. mod.in_dir(), '--backend=toy-c', '--out=' .. out_dir, '--include=' .. mod.include_dir()})
+        local in_dir = mod.in_dir()
+        local args = {'--in=' .. in_dir, '--backend=toy-c', '--out=' .. out_dir, '--include=' .. mod.include_dir()}
+        -- desc.lua may return specialized builds of scripts from variants(), E.g {["test_fib.cpp"] = {{"FIB_LAYER=9"}}}
+        if mod.variants then
+            local variants = mod.variants()
+            for _, file in ipairs(table.orderkeys(variants)) do
+                for _, defines in ipairs(variants[file]) do
+                    table.insert(args, '--variant=' .. file .. ':' .. table.concat(table.wrap(defines), ','))
+                end
+            end
+        end
+        -- {opt = "O0" | "O1" | "O2" | "O3" | "Os", march = "native" | "x86-64-v3" | ...}: optimization level and ISA of the generated C
+        local opt_level = target:extraconf("rules", "compile_clang_script", "opt")
+        if opt_level then
+            table.insert(args, '--opt=' .. opt_level)
+        end
+        local march = target:extraconf("rules", "compile_clang_script", "march")
+        if march then
+            table.insert(args, '--march=' .. march)
+        end
+        -- {isa = {"sse4.2", "avx2", "avx512"}}: exported functions get one clone per ISA, picked by CPUID when the library is loaded,
+        -- static functions only through being inlined into them
+        local isa = target:extraconf("rules", "compile_clang_script", "isa")
+        if isa then
+            table.insert(args, '--isa=' .. table.concat(table.wrap(isa), ','))
+        end
+        -- {profile = true}: #line info pointing at the scripts and frame pointers kept, for perf and other sampling profilers
+        if target:extraconf("rules", "compile_clang_script", "profile") then
+            table.insert(args, '--profile')
+        end
+        -- {report = "size"}: size_report.json in out_dir lists the generated functions by size
+        local report = target:extraconf("rules", "compile_clang_script", "report")
+        if report then
+            table.insert(args, '--report=' .. report)
+        end
+        -- {gc = true}: unreachable static functions are dropped before compiling, the rest by the linker. off by default,
+        -- gcc and clang already discard unused statics, it mostly saves parsing time
+        if target:extraconf("rules", "compile_clang_script", "gc") then
+            table.insert(args, '--gc')
+        end
+        -- {dedup = true}: identical static functions of several scripts are compiled once, in common_*.c
+        -- smaller binaries, but the shared functions are no longer inlined into the scripts without LTO
+        if target:extraconf("rules", "compile_clang_script", "dedup") then
+            table.insert(args, '--dedup')
+        end
+        -- {cc = true}: script_compiler compiles the generated C itself, overlapping with generating the other scripts
+        if target:extraconf("rules", "compile_clang_script", "cc") then
+            local cc = target:tool("cc")
+            table.insert(args, '--cc=' .. cc)
+            for _, flag in ipairs(compiler.compflags(path.join(out_dir, "script.c"), {
+                target = target
+            })) do
+                table.insert(args, '--cflag=' .. flag)
+            end
+        end
+        -- deps.json lists the arguments, sources and every file read by the last successful run
+        -- skip the compiler entirely if nothing changed since then
+        local function up_to_date()
+            local deps_path = path.join(out_dir, "deps.json")
+            if not os.isfile(deps_path) or not os.isfile(path.join(out_dir, "compile_c.lua")) then
+                return false
+            end
+            local deps = try {function()
+                return json.loadfile(deps_path)
+            end}
+            if type(deps) ~= "table" or deps.version ~= 1 or type(deps.args) ~= "table" or type(deps.sources) ~= "table" or
+                type(deps.files) ~= "table" then
+                return false
+            end
+            if #deps.args ~= #args then
+                return false
+            end
+            for i, arg in ipairs(args) do
+                if deps.args[i] ~= arg then
+                    return false
+                end
+            end
+            -- added or removed scripts
+            local sources = {}
+            for _, source in ipairs(deps.sources) do
+                sources[source] = true
+            end
+            local source_count = 0
+            for _, file in ipairs(os.files(path.join(in_dir, "**.cpp"))) do
+                if not sources[path.relative(file, in_dir):gsub("\\", "/")] then
+                    return false
+                end
+                source_count = source_count + 1
+            end
+            if source_count ~= #deps.sources then
+                return false
+            end
+            -- timestamps have second resolution, so a file as new as the manifest counts as changed
+            local deps_time = os.mtime(deps_path)
+            if os.mtime(compiler) >= deps_time or os.mtime(sourcefile) >= deps_time then
+                return false
+            end
+            for _, file in ipairs(deps.files) do
+                if not os.isfile(file) or os.mtime(file) >= deps_time then
+                    return false
+                end
+            end
+            -- generated .c or object files deleted since then, the link table of compile_c.lua lists them
+            local compile_c_code = io.readfile(path.join(out_dir, "compile_c.lua"))
+            local link_table = compile_c_code:match("local link = {(.-)}")
+            if not link_table then
+                return false
+            end
+            for file in link_table:gmatch('"(.-)"') do
+                if not os.isfile(file) then
+                    return false
+                end
+            end
+            return true
+        end
+        if up_to_date() then
+            return
+        end
+        os.vrunv(compiler, args)
     end)
 
     on_buildcmd_file(function(target, batchcmds, sourcefile, opt)
+        import("core.base.json")
         local out_dir = target:extraconf("rules", "compile_clang_script", "out_dir")
         out_dir = path.join(target:targetdir(), out_dir)
         local compile_c = import("compile_c", {
             rootdir = out_dir
         })
         local link_files, compile_files = compile_c.files()
+        -- same selection as script_compiler --cc uses
+        local configs = {}
+        local opt_level = target:extraconf("rules", "compile_clang_script", "opt")
+        if opt_level then
+            configs.optimize = ({
+                O0 = "none",
+                O1 = "fast",
+                O2 = "faster",
+                O3 = "fastest",
+                Os = "smallest"
+            })[opt_level]
+        end
+        local march = target:extraconf("rules", "compile_clang_script", "march")
+        if march then
+            if not target:has_tool("cc", "cl", "clang_cl") then
+                configs.cflags = {"-march=" .. march}
+            elseif march == "x86-64-v3" or march == "haswell" then
+                configs.cflags = {"/arch:AVX2"}
+            elseif march == "x86-64-v4" or march == "skylake-avx512" then
+                configs.cflags = {"/arch:AVX512"}
+            elseif not target:extraconf("rules", "compile_clang_script", "cc") then
+                print("warning: march = \"" .. march .. "\" has no /arch option of cl, the scripts are built for its default ISA")
+            end
+        end
+        if target:extraconf("rules", "compile_clang_script", "profile") then
+            configs.symbols = "debug"
+            configs.cflags = table.join(configs.cflags or {},
+                target:has_tool("cc", "cl", "clang_cl") and "/Oy-" or "-fno-omit-frame-pointer")
+        end
         for _, out_file in ipairs(link_files) do
-            local objectfile = target:objectfile(out_file)
+            -- objects already compiled by script_compiler --cc are linked as they are
+            local objectfile = out_file
+            if path.extension(out_file) == ".c" then
+                objectfile = target:objectfile(out_file)
+            end
             table.insert(target:objectfiles(), objectfile)
         end
+        -- the merged profile is used for the scripts whose code hash was instrumented in the training run,
+        -- a script whose code changed since then is built without it
+        local pgo = get_config("script_pgo")
+        local pgo_dir = path.join(os.projectdir(), ".pgo", target:name())
+        local raw_dir = path.join(pgo_dir, "raw")
+        local instrumented_path = path.join(pgo_dir, "instrumented.json")
+        local profile = path.join(pgo_dir, "merged.profdata")
+        local profiled_path = path.join(pgo_dir, "profiled.json")
+        local pgo_files = {}
+        if pgo == "generate" or pgo == "use" then
+            if target:extraconf("rules", "compile_clang_script", "cc") then
+                print("warning: script_pgo is ignored for scripts compiled by script_compiler --cc")
+            else
+                for _, out_file in ipairs(link_files) do
+                    if path.extension(out_file) == ".c" then
+                        pgo_files[out_file] = hash.sha256(out_file)
+                    end
+                end
+            end
+        end
+        if pgo == "generate" then
+            -- raw profiles of the last training run stay valid while the instrumented code is the same
+            local instrumented = os.isfile(instrumented_path) and json.loadfile(instrumented_path) or {}
+            local same = true
+            for out_file, code_hash in pairs(pgo_files) do
+                same = same and instrumented[out_file] == code_hash
+            end
+            for out_file, _ in pairs(instrumented) do
+                same = same and pgo_files[out_file] ~= nil
+            end
+            if not same then
+                os.tryrm(raw_dir)
+                json.savefile(instrumented_path, pgo_files)
+            end
+            os.mkdir(raw_dir)
+        elseif pgo == "use" then
+            local raw_files = os.files(path.join(raw_dir, "*.profraw"))
+            if #raw_files > 0 and os.isfile(instrumented_path) then
+                import("lib.detect.find_tool")
+                local profdata = assert(find_tool("llvm-profdata"), "llvm-profdata not found")
+                os.vrunv(profdata.program, table.join({"merge", "-o", profile}, raw_files))
+                os.cp(instrumented_path, profiled_path)
+                os.rm(raw_dir)
+            end
+        end
+        local profiled = {}
+        if pgo == "use" and os.isfile(profile) and os.isfile(profiled_path) then
+            for _, code_hash in pairs(json.loadfile(profiled_path)) do
+                profiled[code_hash] = true
+            end
+        end
+        -- the PGO flags every object was last built with, an object whose flags changed is compiled again
+        local objects_path = path.join(pgo_dir, "objects.json")
+        local objects = os.isfile(objects_path) and json.loadfile(objects_path) or {}
+        local objects_changed = false
+        local compile_set = {}
         for _, file_idx in ipairs(compile_files) do
-            local out_file = link_files[file_idx]
-            local objectfile = target:objectfile(out_file)
-            batchcmds:compile(out_file, objectfile)
-            batchcmds:show('compiling ' .. path.filename(out_file))
+            compile_set[link_files[file_idx]] = true
+        end
+        for _, out_file in ipairs(link_files) do
+            if path.extension(out_file) == ".c" then
+                local file_configs = configs
+                local pgo_flags
+                local pgo_key
+                local code_hash = pgo_files[out_file]
+                if code_hash and pgo == "generate" then
+                    pgo_flags = {"-fprofile-instr-generate=" .. path.join(raw_dir, "%m-%p.profraw")}
+                    pgo_key = "generate"
+                elseif code_hash and profiled[code_hash] then
+                    pgo_flags = {"-fprofile-instr-use=" .. profile, "-Wno-profile-instr-unprofiled"}
+                    pgo_key = "use:" .. tostring(os.mtime(profile))
+                end
+                if pgo_flags then
+                    file_configs = {
+                        optimize = configs.optimize,
+                        cflags = table.join(configs.cflags or {}, pgo_flags)
+                    }
+                end
+                if objects[out_file] ~= pgo_key then
+                    objects[out_file] = pgo_key
+                    objects_changed = true
+                    compile_set[out_file] = true
+                end
+                local objectfile = target:objectfile(out_file)
+                if compile_set[out_file] or not os.isfile(objectfile) then
+                    batchcmds:compile(out_file, objectfile, {
+                        configs = file_configs
+                    })
+                    batchcmds:show('compiling ' .. path.filename(out_file))
+                end
+            end
+        end
+        if objects_changed then
+            os.mkdir(pgo_dir)
+            json.savefile(objects_path, objects)
         end
     end)
     rule_end()
+
+    -- Unit test of the --dedup pass, not built by default.
+    -- xmake build test_function_dedup && xmake run test_function_dedup
+    target("test_function_dedup")
+    set_default(false)
+    add_rules("lc_basic_settings", {
+        project_kind = "binary"
+    })
+    add_includedirs(".")
+    add_files("test/test_function_dedup.cpp")
+    add_deps("lc-core", "lc-vstl")
+    target_end()
 end
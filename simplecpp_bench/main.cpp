@@ -0,0 +1,372 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <new>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "simplecpp.h"
+#include "token_cache.h"
+#include "utils.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Benchmarks for the simplecpp copy used by script_compiler.
+// Lexes, loads and preprocesses the test scripts and generated inputs the same way script_compiler does,
+// and prints ns/token, allocations per token and the peak RSS as JSON.
+// Allocations are the ones through operator new, the token cache allocates its images with luisa's allocator.
+// Inputs reporting an error keep it in their results and make the run exit with 1.
+// Synthetic inputs with expected names are checked in lazy and eager mode first, a missing name fails the run.
+// Usage: simplecpp_bench [--scripts=<test_lc_script/scripts>] [--reps=<n>]
+
+static std::atomic_size_t allocation_count{0};
+
+void* operator new(size_t size) {
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+	if (auto ptr = std::malloc(size ? size : 1)) return ptr;
+	throw std::bad_alloc{};
+}
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+void operator delete(void* ptr) noexcept {
+	std::free(ptr);
+}
+void operator delete[](void* ptr) noexcept {
+	std::free(ptr);
+}
+void operator delete(void* ptr, size_t) noexcept {
+	std::free(ptr);
+}
+void operator delete[](void* ptr, size_t) noexcept {
+	std::free(ptr);
+}
+
+static size_t peak_rss() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters{};
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return counters.PeakWorkingSetSize;
+#else
+	rusage usage{};
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+	return static_cast<size_t>(usage.ru_maxrss);
+#else
+	return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+struct Input {
+	std::string name;
+	std::filesystem::path path;
+	// translation units go through all phases, headers are only lexed
+	bool translation_unit;
+	// names the preprocessed output must contain
+	std::vector<std::string> expected;
+};
+
+struct Result {
+	std::string name;
+	char const* phase;
+	size_t bytes;
+	size_t tokens;
+	double ns_per_token;
+	double allocs_per_token;
+	// first diagnostic of the input, empty if it preprocessed cleanly
+	std::string error;
+};
+
+static simplecpp::DUI make_dui(std::vector<std::filesystem::path> const& include_paths) {
+	// same settings as Preprocessor::require_recompile
+	simplecpp::DUI dui;
+	dui.removeComments = true;
+	dui.lazyConditionals = true;
+	for (auto&& i : include_paths) {
+		dui.includePaths.emplace_back(i.string());
+	}
+	return dui;
+}
+
+// Preprocesses a translation unit once without and once with lazyConditionals and reports expected names missing from the output.
+static bool check_input(Input const& input, std::vector<std::filesystem::path> const& include_paths) {
+	bool ok = true;
+	for (bool lazy : {false, true}) {
+		auto dui = make_dui(include_paths);
+		dui.lazyConditionals = lazy;
+		std::vector<std::string> files;
+		simplecpp::OutputList output_list;
+		simplecpp::TokenList rawtokens(input.path.string(), files, &output_list, lazy);
+		rawtokens.removeComments();
+		auto filedata = simplecpp::load(rawtokens, files, dui, &output_list);
+		simplecpp::TokenList output(files);
+		simplecpp::preprocess(output, rawtokens, files, filedata, dui, &output_list);
+		simplecpp::cleanup(filedata);
+		std::set<std::string> names;
+		for (auto tok = output.cfront(); tok; tok = tok->next) {
+			if (tok->name) names.insert(tok->str());
+		}
+		for (auto&& i : input.expected) {
+			if (names.count(i)) continue;
+			std::fprintf(stderr, "%s: '%s' is missing from the %s output.\n", input.name.c_str(), i.c_str(), lazy ? "lazy" : "eager");
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+static size_t count_tokens(simplecpp::TokenList const& list) {
+	size_t count = 0;
+	for (auto tok = list.cfront(); tok; tok = tok->next) {
+		++count;
+	}
+	return count;
+}
+
+// Diagnostics fail the input, warnings are fine.
+static std::string first_error(simplecpp::OutputList const& output_list) {
+	for (auto&& i : output_list) {
+		if (i.type == simplecpp::Output::WARNING || i.type == simplecpp::Output::PORTABILITY_BACKSLASH) continue;
+		return i.location.file() + ":" + std::to_string(i.location.line) + ": " + i.msg;
+	}
+	return {};
+}
+
+// Every phase is run reps times; the fastest run is reported, allocations are counted on the first one.
+// The cached phases load headers through a TokenCache like script_compiler does. Every run gets a new cache on the same
+// directory, so runs after the first one map the entries written before, as a second script_compiler run would.
+static void bench_input(Input const& input, std::vector<std::filesystem::path> const& include_paths, std::filesystem::path const& cache_dir, int reps, std::vector<Result>& results) {
+	using clock = std::chrono::steady_clock;
+	auto const path = input.path.string();
+	auto const bytes = static_cast<size_t>(std::filesystem::file_size(input.path));
+	auto const dui = make_dui(include_paths);
+	double best[5] = {1e300, 1e300, 1e300, 1e300, 1e300};
+	size_t allocs[5] = {};
+	size_t raw_tokens = 0;
+	size_t all_tokens = 0;
+	std::string error;
+	auto measure = [&](int rep, int phase, auto&& func) {
+		auto allocs_before = allocation_count.load(std::memory_order_relaxed);
+		auto t0 = clock::now();
+		func();
+		auto t1 = clock::now();
+		best[phase] = std::min(best[phase], std::chrono::duration<double, std::nano>(t1 - t0).count());
+		if (rep == 0) allocs[phase] = allocation_count.load(std::memory_order_relaxed) - allocs_before;
+	};
+	for (int rep = 0; rep < reps; ++rep) {
+		std::vector<std::string> files;
+		simplecpp::OutputList output_list;
+		simplecpp::TokenList* rawtokens = nullptr;
+		measure(rep, 0, [&] {
+			rawtokens = new simplecpp::TokenList(path, files, &output_list, dui.lazyConditionals);
+			rawtokens->removeComments();
+		});
+		raw_tokens = count_tokens(*rawtokens);
+		if (input.translation_unit) {
+			std::map<std::string, simplecpp::TokenList*> filedata;
+			measure(rep, 1, [&] {
+				filedata = simplecpp::load(*rawtokens, files, dui, &output_list);
+			});
+			simplecpp::TokenList output(files);
+			measure(rep, 2, [&] {
+				simplecpp::preprocess(output, *rawtokens, files, filedata, dui, &output_list);
+			});
+			// headers inside conditional blocks are only read by preprocess
+			all_tokens = raw_tokens;
+			for (auto&& i : filedata) {
+				all_tokens += count_tokens(*i.second);
+			}
+			simplecpp::cleanup(filedata);
+
+			TokenCache cache{std::filesystem::path{cache_dir}};
+			auto cached_dui = dui;
+			cached_dui.headerLoader = &cache;
+			measure(rep, 3, [&] {
+				filedata = simplecpp::load(*rawtokens, files, cached_dui, &output_list);
+			});
+			simplecpp::TokenList cached_output(files);
+			measure(rep, 4, [&] {
+				simplecpp::preprocess(cached_output, *rawtokens, files, filedata, cached_dui, &output_list);
+			});
+			simplecpp::cleanup(filedata);
+		}
+		delete rawtokens;
+		if (rep == 0) error = first_error(output_list);
+	}
+	auto add = [&](int phase, char const* phase_name, size_t tokens) {
+		tokens = std::max<size_t>(tokens, 1);
+		results.push_back(Result{input.name, phase_name, bytes, tokens, best[phase] / tokens, static_cast<double>(allocs[phase]) / tokens, error});
+	};
+	add(0, "lex", raw_tokens);
+	if (input.translation_unit) {
+		// load and preprocess are normalized by the tokens of the source and all headers it reads
+		add(1, "load", all_tokens);
+		add(2, "preprocess", all_tokens);
+		add(3, "cached_load", all_tokens);
+		add(4, "cached_preprocess", all_tokens);
+	}
+}
+
+static void write_file(std::filesystem::path const& path, std::string const& text) {
+	std::ofstream file(path, std::ios::binary);
+	file << text;
+}
+
+// Swizzle style declarations like luisa/types/ops/swizzle4.inl, but with per_line declarations on each line.
+static std::string swizzle_source(size_t lines, size_t per_line) {
+	static char const components[] = "xyzw";
+	std::string src;
+	for (size_t line = 0; line < lines; ++line) {
+		src += "[[swizzle]]";
+		for (size_t i = 0; i < per_line; ++i) {
+			src += " vec<T, 4> /* ";
+			src += std::to_string(i);
+			src += " */ &";
+			for (size_t c = 0, v = line * per_line + i; c < 4; ++c, v /= 4) {
+				src += components[v % 4];
+			}
+			src += ',';
+		}
+		src += '\n';
+	}
+	return src;
+}
+
+// Headers including each other in a chain, each with an include guard and a few macros.
+static std::string deep_include_source(std::filesystem::path const& dir, size_t depth) {
+	for (size_t i = 0; i < depth; ++i) {
+		std::string src;
+		auto guard = "DEEP_" + std::to_string(i) + "_H";
+		src += "#ifndef " + guard + "\n#define " + guard + "\n";
+		if (i + 1 < depth) {
+			src += "#include \"deep_" + std::to_string(i + 1) + ".h\"\n";
+		}
+		src += "#define DEEP_VALUE_" + std::to_string(i) + " (" + std::to_string(i) + " + 1)\n";
+		src += "#if defined(DEEP_VALUE_" + std::to_string(i) + ") && DEEP_VALUE_" + std::to_string(i) + " > 0\n";
+		src += "static int deep_" + std::to_string(i) + "(int x) { return x + DEEP_VALUE_" + std::to_string(i) + "; }\n";
+		src += "#endif\n#endif\n";
+		write_file(dir / ("deep_" + std::to_string(i) + ".h"), src);
+	}
+	return "#include \"deep_0.h\"\n#include \"deep_0.h\"\nint main() { return deep_0(0); }\n";
+}
+
+// Declarations named after their __LINE__ behind multi-line block comments, in and after conditional blocks.
+static std::string line_numbers_source() {
+	return "#define CAT(a, b) a##b\n"
+		   "#define LINE_NAME(l) CAT(line_, l)\n"
+		   "#if 1\n"
+		   "/* starts on the line after #if\n"
+		   "*/ int LINE_NAME(__LINE__);\n"
+		   "int LINE_NAME(__LINE__); /* spans\n"
+		   "two lines */\n"
+		   "#endif\n"
+		   "/* starts on the line after #endif\n"
+		   "*/ int LINE_NAME(__LINE__);\n";
+}
+
+// Heavy use of attribute macros and function like macros, like kernel_1d from attributes.hpp.
+static std::string macro_heavy_source(size_t functions) {
+	std::string src;
+	src += "#define ATTR(x) [[clang::annotate(#x)]]\n";
+	src += "#define kernel_1d(x) ATTR(kernel_1d) ATTR(x)\n";
+	src += "#define access ATTR(access)\n";
+	src += "#define ADD(a, b) ((a) + (b))\n";
+	src += "#define MUL(a, b) ((a) * (b))\n";
+	src += "#define MAD(a, b, c) ADD(MUL(a, b), c)\n";
+	src += "#define VERSION 3\n";
+	for (size_t i = 0; i < functions; ++i) {
+		auto n = std::to_string(i);
+		src += "#if VERSION >= 2 && defined(MAD)\n";
+		src += "kernel_1d(128) access void f" + n + "(int x) { return MAD(x, ADD(x, 1), MUL(x, " + n + ")); }\n";
+		src += "#else\nvoid f" + n + "();\n#endif\n";
+	}
+	return src;
+}
+
+int main(int argc, char* argv[]) {
+	std::filesystem::path scripts_dir = SIMPLECPP_BENCH_SCRIPTS;
+	int reps = 5;
+	for (int i = 1; i < argc; ++i) {
+		std::string_view arg{argv[i]};
+		if (arg.starts_with("--scripts=")) {
+			scripts_dir = arg.substr(10);
+		} else if (arg.starts_with("--reps=")) {
+			reps = std::max(1, std::atoi(argv[i] + 7));
+		} else {
+			std::fprintf(stderr, "Unknown argument '%s'.\n", argv[i]);
+			return 1;
+		}
+	}
+	auto include_dir = scripts_dir / "include";
+	if (!std::filesystem::exists(include_dir)) {
+		std::fprintf(stderr, "Script include directory '%s' does not exist, use --scripts=.\n", include_dir.string().c_str());
+		return 1;
+	}
+
+	std::vector<Input> inputs;
+	for (auto&& entry : std::filesystem::directory_iterator(scripts_dir / "src")) {
+		if (entry.path().extension() == ".cpp") {
+			inputs.push_back(Input{"src/" + entry.path().filename().string(), entry.path(), true});
+		}
+	}
+	for (auto&& entry : std::filesystem::recursive_directory_iterator(include_dir)) {
+		if (entry.is_regular_file()) {
+			inputs.push_back(Input{"include/" + std::filesystem::relative(entry.path(), include_dir).generic_string(), entry.path(), false});
+		}
+	}
+	std::sort(inputs.begin(), inputs.end(), [](Input const& a, Input const& b) { return a.name < b.name; });
+
+	auto synthetic_dir = std::filesystem::temp_directory_path() / "simplecpp_bench";
+	std::filesystem::create_directories(synthetic_dir);
+	write_file(synthetic_dir / "deep_include.cpp", deep_include_source(synthetic_dir, 256));
+	write_file(synthetic_dir / "line_numbers.cpp", line_numbers_source());
+	write_file(synthetic_dir / "macro_heavy.cpp", macro_heavy_source(4000));
+	write_file(synthetic_dir / "swizzle_long_lines.inl", swizzle_source(20, 1024));
+	write_file(synthetic_dir / "swizzle_short_lines.inl", swizzle_source(20 * 1024, 1));
+	// raw conditional blocks must not count toward the include depth limit of 400
+	inputs.push_back(Input{"synthetic/deep_include.cpp", synthetic_dir / "deep_include.cpp", true, {"deep_255"}});
+	inputs.push_back(Input{"synthetic/line_numbers.cpp", synthetic_dir / "line_numbers.cpp", true, {"line_5", "line_6", "line_10"}});
+	inputs.push_back(Input{"synthetic/macro_heavy.cpp", synthetic_dir / "macro_heavy.cpp", true});
+	inputs.push_back(Input{"synthetic/swizzle_long_lines.inl", synthetic_dir / "swizzle_long_lines.inl", false});
+	inputs.push_back(Input{"synthetic/swizzle_short_lines.inl", synthetic_dir / "swizzle_short_lines.inl", false});
+
+	std::vector<std::filesystem::path> include_paths{include_dir, synthetic_dir};
+	bool checked = true;
+	for (auto&& input : inputs) {
+		if (!input.expected.empty()) checked = check_input(input, include_paths) && checked;
+	}
+	if (!checked) return 1;
+	// started before the inputs so prefetches run while simplecpp works on a file
+	luisa::fiber::scheduler thread_pool(std::thread::hardware_concurrency());
+	auto cache_dir = synthetic_dir / "token_cache";
+	std::vector<Result> results;
+	bool failed = false;
+	for (auto&& input : inputs) {
+		bench_input(input, include_paths, cache_dir, reps, results);
+		if (!results.back().error.empty()) {
+			std::fprintf(stderr, "%s failed: %s\n", input.name.c_str(), results.back().error.c_str());
+			failed = true;
+		}
+	}
+
+	std::printf("{\n  \"reps\": %d,\n  \"peak_rss_bytes\": %zu,\n  \"results\": [\n", reps, peak_rss());
+	for (size_t i = 0; i < results.size(); ++i) {
+		auto const& r = results[i];
+		std::printf("    {\"name\": %s, \"phase\": \"%s\", \"bytes\": %zu, \"tokens\": %zu, \"ns_per_token\": %.2f, \"allocs_per_token\": %.3f, \"error\": %s}%s\n",
+					json_string(r.name).c_str(), r.phase, r.bytes, r.tokens, r.ns_per_token, r.allocs_per_token, r.error.empty() ? "null" : json_string(r.error).c_str(), i + 1 < results.size() ? "," : "");
+	}
+	std::printf("  ]\n}\n");
+	return failed ? 1 : 0;
+}
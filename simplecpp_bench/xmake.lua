@@ -0,0 +1,19 @@
+-- Benchmarks for the simplecpp copy used by script_compiler, not built by default.
+-- xmake build simplecpp_bench && xmake run simplecpp_bench > simplecpp_bench.json
+target("simplecpp_bench")
+set_default(false)
+add_rules("lc_basic_settings", {
+    project_kind = "binary"
+})
+add_includedirs("../script_compiler")
+add_files("main.cpp", "../script_compiler/simplecpp.cpp")
+-- the cached phases use script_compiler's TokenCache
+add_deps("lc-core", "lc-vstl")
+on_load(function(target)
+    local scripts_dir = path.join(os.projectdir(), "test_lc_script", "scripts"):gsub("\\", "/")
+    target:add("defines", "SIMPLECPP_BENCH_SCRIPTS=\"" .. scripts_dir .. "\"")
+end)
+if is_plat("windows") then
+    add_syslinks("psapi")
+end
+target_end()
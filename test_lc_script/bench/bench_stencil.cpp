@@ -0,0 +1,93 @@
+#include <luisa/backends/ext/toy_c_ext.h>
+#include <luisa/runtime/context.h>
+#include <luisa/runtime/device.h>
+#include <luisa/runtime/stream.h>
+#include <luisa/runtime/shader.h>
+#include <luisa/core/fiber.h>
+#include <luisa/core/logging.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string_view>
+using namespace luisa;
+using namespace luisa::compute;
+
+// Dispatch order of a 2D stencil on the toy-c backend.
+// Runs the bench_stencil script over a square image once per order of functions/dispatch_order.hpp
+// (row major, 16x16 tiles, Morton), each built as its own kernel, and prints the fastest run of each as JSON.
+// Usage: bench_stencil [--size=<power of two edge, 4096 by default>] [--reps=<n>]
+
+struct ToyCDeviceConfigImpl : public luisa::compute::ToyCDeviceConfig {
+    luisa::string dynamic_module_name() const override
+    {
+        return "d6_scripts";
+    }
+};
+
+struct HostBuffer {
+    uint64_t ptr;
+    uint64_t len;
+};
+
+int main(int argc, char* argv[])
+{
+    uint edge = 4096;
+    int  reps = 5;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg{ argv[i] };
+        if (arg.starts_with("--size=")) {
+            edge = std::max(16, std::atoi(argv[i] + 7));
+        } else if (arg.starts_with("--reps=")) {
+            reps = std::max(1, std::atoi(argv[i] + 7));
+        } else {
+            std::fprintf(stderr, "Unknown argument '%s'.\n", argv[i]);
+            return 1;
+        }
+    }
+    if ((edge & (edge - 1)) != 0) {
+        std::fprintf(stderr, "Size %u is not a power of two, Morton order needs one.\n", edge);
+        return 1;
+    }
+    fiber::scheduler tpool;
+    Context          context{ argv[0] };
+    DeviceConfig     config{
+            .extension = luisa::make_unique<ToyCDeviceConfigImpl>()
+    };
+    auto device = context.create_device("toy-c", &config);
+    // STENCIL_ORDER builds of bench_stencil.cpp, see variants() in scripts/desc.lua
+    luisa::vector<Shader1D<HostBuffer, HostBuffer, uint2>> shaders;
+    shaders.emplace_back(device.load_shader<1, HostBuffer, HostBuffer, uint2>("bench_stencil"));
+    shaders.emplace_back(device.load_shader<1, HostBuffer, HostBuffer, uint2>("bench_stencil_STENCIL_ORDER_1"));
+    shaders.emplace_back(device.load_shader<1, HostBuffer, HostBuffer, uint2>("bench_stencil_STENCIL_ORDER_2"));
+    auto stream = device.create_stream();
+
+    size_t               pixels = size_t(edge) * edge;
+    luisa::vector<float> src(pixels);
+    luisa::vector<float> dst(pixels, 0.0f);
+    for (size_t i = 0; i < pixels; ++i) {
+        src[i] = static_cast<float>(i % 251);
+    }
+
+    constexpr char const* order_names[] = { "row_major", "tiled_16x16", "morton" };
+    using clock = std::chrono::steady_clock;
+    std::printf("{\n  \"size\": %u,\n  \"reps\": %d,\n  \"results\": [\n", edge, reps);
+    for (uint order = 0; order < 3; ++order) {
+        double best = 1e300;
+        // the first run is warm up
+        for (int rep = 0; rep <= reps; ++rep) {
+            auto t0 = clock::now();
+            stream << shaders[order](HostBuffer{ reinterpret_cast<uint64_t>(dst.data()), dst.size() },
+                                     HostBuffer{ reinterpret_cast<uint64_t>(src.data()), src.size() },
+                                     make_uint2(edge))
+                          .dispatch(pixels)
+                   << synchronize();
+            auto t1 = clock::now();
+            if (rep > 0) best = std::min(best, std::chrono::duration<double, std::milli>(t1 - t0).count());
+        }
+        // one read and one write of every pixel
+        std::printf("    {\"order\": \"%s\", \"ms\": %.3f, \"gb_per_s\": %.2f}%s\n",
+                    order_names[order], best, pixels * 2.0 * sizeof(float) / (best * 1e6), order + 1 < 3 ? "," : "");
+    }
+    std::printf("  ]\n}\n");
+    return 0;
+}
@@ -4,4 +4,12 @@ end
 
 function include_dir()
     return path.join(os.scriptdir(), "include")
-end
\ No newline at end of file
+end
+
+-- specialized builds, each adds <name>_<defines>.c next to the plain one
+function variants()
+    return {
+        ["test_fib.cpp"] = {{"FIB_LAYER=9"}},
+        ["bench_stencil.cpp"] = {{"STENCIL_ORDER=1"}, {"STENCIL_ORDER=2"}}
+    }
+end
@@ -0,0 +1,35 @@
+#pragma once
+#include "./../types/vec.hpp"
+
+namespace luisa::shader {
+
+// Orders of visiting a 2D grid from a linear index, for kernels dispatched in 1D over width * height threads.
+// Consecutive indices run in the same block on the same worker, so the order decides which rows share the cache.
+// Not part of functions.hpp, a script that picks an order includes this file.
+
+uint2 row_major_id(uint32 index, uint2 size) {
+	return uint2(index % size.x, index / size.x);
+}
+// tile.x * tile.y consecutive indices cover one tile, the tiles are row major. size must be a multiple of tile
+uint2 tiled_id(uint32 index, uint2 size, uint2 tile) {
+	auto tile_threads = tile.x * tile.y;
+	auto tile_index = index / tile_threads;
+	auto local = index % tile_threads;
+	auto tiles_x = size.x / tile.x;
+	return uint2((tile_index % tiles_x) * tile.x + local % tile.x, (tile_index / tiles_x) * tile.y + local / tile.x);
+}
+// even bits of v packed into the low half
+uint32 morton_compact(uint32 v) {
+	v &= 0x55555555u;
+	v = (v | (v >> 1u)) & 0x33333333u;
+	v = (v | (v >> 2u)) & 0x0f0f0f0fu;
+	v = (v | (v >> 4u)) & 0x00ff00ffu;
+	v = (v | (v >> 8u)) & 0x0000ffffu;
+	return v;
+}
+// Z order, for square power of two grids
+uint2 morton_id(uint32 index) {
+	return uint2(morton_compact(index), morton_compact(index >> 1u));
+}
+
+}// namespace luisa::shader
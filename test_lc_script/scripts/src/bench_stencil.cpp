@@ -0,0 +1,29 @@
+#include <luisa/std.hpp>
+#include <luisa/functions/dispatch_order.hpp>
+using namespace luisa::shader;
+
+// 5 point stencil over a size.x * size.y image for bench_stencil, one build per order so no thread branches on it:
+// STENCIL_ORDER 0 row major, 1 16x16 tiles, 2 Morton. See variants() in desc.lua
+#ifndef STENCIL_ORDER
+#define STENCIL_ORDER 0
+#endif
+[[kernel_1d(256)]] int kernel(Buffer<float>& dst, Buffer<float>& src, uint2 size) {
+#if STENCIL_ORDER == 1
+	auto p = tiled_id(dispatch_id().x, size, uint2(16u, 16u));
+#elif STENCIL_ORDER == 2
+	auto p = morton_id(dispatch_id().x);
+#else
+	auto p = row_major_id(dispatch_id().x, size);
+#endif
+	if (p.x >= size.x || p.y >= size.y) {
+		return 0;
+	}
+	uint64 idx = uint64(p.y) * uint64(size.x) + uint64(p.x);
+	float c = src[idx];
+	float l = p.x > 0 ? src[idx - 1] : c;
+	float r = p.x + 1 < size.x ? src[idx + 1] : c;
+	float u = p.y > 0 ? src[idx - size.x] : c;
+	float d = p.y + 1 < size.y ? src[idx + size.x] : c;
+	dst[idx] = (c * 4.0f + l + r + u + d) * 0.125f;
+	return 0;
+}
@@ -0,0 +1,16 @@
+#include <luisa/std.hpp>
+#include <luisa/functions/dispatch_order.hpp>
+using namespace luisa::shader;
+
+// every order maps the 64 * 64 indices onto the 64x64 grid once, counts[order * 4096 + pixel] ends at 1
+[[kernel_1d(64)]] int kernel(Buffer<uint32>& counts) {
+	auto index = dispatch_id().x;
+	auto size = uint2(64u, 64u);
+	auto row_major = row_major_id(index, size);
+	auto tiled = tiled_id(index, size, uint2(16u, 8u));
+	auto morton = morton_id(index);
+	atomic_add(counts[row_major.y * 64u + row_major.x], 1u);
+	atomic_add(counts[4096u + tiled.y * 64u + tiled.x], 1u);
+	atomic_add(counts[8192u + morton.y * 64u + morton.x], 1u);
+	return 0;
+}
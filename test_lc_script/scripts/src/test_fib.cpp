@@ -12,8 +12,16 @@ int fib(int layer) {
 	}
 }
 
+#ifdef FIB_LAYER
+// specialized build, the layer is a constant the C compiler can fold the recursion with
+[[kernel_1d(1)]] int kernel() {
+    device_log("Fibo: {}", fib(FIB_LAYER));
+	return 0;
+}
+#else
 [[kernel_1d(1)]] int kernel(
 	int layer) {
     device_log("Fibo: {}", fib(layer));
 	return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,37 @@
+#include <luisa/std.hpp>
+using namespace luisa::shader;
+
+// #if conditions follow C precedence whichever evaluator of script_compiler's preprocessor folds them,
+// a wrong result stops the build of d6_scripts here.
+
+// plain integer and character literal conditions, folded by the precedence climbing evaluator
+#if !(1 || 0 && 0)
+#error "&& must bind tighter than ||"
+#endif
+#if !(1 || 0 && 'a' == 0)
+#error "&& must bind tighter than || next to character literals"
+#endif
+#if !(0 == 1 < 0)
+#error "< must bind tighter than =="
+#endif
+#if '\n' != 10 || 'a' + 1 != 'b'
+#error "wrong character literal value"
+#endif
+
+// alternative operator spellings, folded by the fallback
+#if !(1 or 0 and 0)
+#error "and must bind tighter than or"
+#endif
+#if !(1 or 0 and 'a' == 0)
+#error "and must bind tighter than or next to character literals"
+#endif
+#if !(0 == 1 < 0 and 1)
+#error "< must bind tighter than == in the fallback"
+#endif
+#if !(0 not_eq 2 > 1)
+#error "> must bind tighter than not_eq"
+#endif
+
+[[kernel_1d(1)]] int kernel() {
+	return 0;
+}
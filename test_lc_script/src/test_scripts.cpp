@@ -37,9 +37,14 @@ int main(int argc, char* argv[])
     };
     auto device               = context.create_device("toy-c", &config);
     auto test_fib_shader      = device.load_shader<1, int>("test_fib");
+    // built from test_fib.cpp with FIB_LAYER=9, see variants() in scripts/desc.lua
+    auto test_fib_9_shader    = device.load_shader<1>("test_fib_FIB_LAYER_9");
     auto test_atomic          = device.load_shader<1, HostBuffer>("test_atomic");
     auto test_func_ptr_shader = device.load_shader<1, FuncRef>("test_func_ptr");
+    auto test_order_shader    = device.load_shader<1, HostBuffer>("test_dispatch_order");
     uint atomic_value         = 114514;
+    // visits of every pixel of a 64x64 grid by row_major_id, tiled_id and morton_id
+    luisa::vector<uint> order_counts(3 * 4096, 0);
 
     auto stream = device.create_stream();
     stream.set_log_callback([](auto&& str) {
@@ -47,7 +52,15 @@ int main(int argc, char* argv[])
     });
 
     stream << test_fib_shader(9).dispatch(1)
+           << test_fib_9_shader().dispatch(1)
            << test_atomic(HostBuffer{ reinterpret_cast<uint64_t>(&atomic_value), sizeof(atomic_value) }).dispatch(1)
-           << test_func_ptr_shader(FuncRef{ reinterpret_cast<uint64_t>(&host_func) }).dispatch(1);
+           << test_func_ptr_shader(FuncRef{ reinterpret_cast<uint64_t>(&host_func) }).dispatch(1)
+           << test_order_shader(HostBuffer{ reinterpret_cast<uint64_t>(order_counts.data()), order_counts.size() }).dispatch(4096)
+           << synchronize();
+    for (size_t i = 0; i < order_counts.size(); ++i) {
+        if (order_counts[i] != 1) {
+            LUISA_ERROR("test_dispatch_order: order {} visited pixel {} {} times.", i / 4096, i % 4096, order_counts[i]);
+        }
+    }
     return 0;
 }
\ No newline at end of file
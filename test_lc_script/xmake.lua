@@ -9,3 +9,17 @@ add_deps("d6_scripts", {
     inherit = false
 })
 target_end()
+
+-- Dispatch order benchmark of a 4K by 4K stencil, not built by default.
+-- xmake build bench_stencil && xmake run bench_stencil > bench_stencil.json
+target("bench_stencil")
+set_default(false)
+add_rules("lc_basic_settings", {
+    project_kind = "binary"
+})
+add_deps("lc-runtime")
+add_files("bench/bench_stencil.cpp")
+add_deps("d6_scripts", {
+    inherit = false
+})
+target_end()
\ No newline at end of file
@@ -37,4 +37,4 @@ lc_options = {
     toy_c_backend = true
 }
 
-includes("LuisaCompute", "test_lc_script", "script_compiler")
+includes("LuisaCompute", "test_lc_script", "script_compiler", "simplecpp_bench")